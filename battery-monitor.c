@@ -1,3 +1,5 @@
+#define _GNU_SOURCE // sendmmsg()
+
 #include <ncurses.h>
 #include <unistd.h>
 #include <sys/types.h>
@@ -10,11 +12,59 @@
 #include <signal.h>
 #include <stdio.h>
 #include <getopt.h>
+#include <limits.h>
+
+#include <errno.h>
+#include <stdarg.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <termios.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <stdint.h>
+#include <math.h>
+#include <spawn.h>
+#include <sys/ioctl.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netdb.h>
+
+#ifdef COUNT_ALLOCATIONS
+/*
+ * Benchmark builds count the heap allocations of the whole process, curses
+ * too, by wrapping the allocator of the C library.
+ */
+extern void* __libc_malloc(size_t size);
+extern void* __libc_calloc(size_t count, size_t size);
+extern void* __libc_realloc(void* pointer, size_t size);
+
+static atomic_ulong allocations = 0;
+
+void* malloc(size_t size) {
+  atomic_fetch_add_explicit(&allocations, 1, memory_order_relaxed);
+  return __libc_malloc(size);
+}
+
+void* calloc(size_t count, size_t size) {
+  atomic_fetch_add_explicit(&allocations, 1, memory_order_relaxed);
+  return __libc_calloc(count, size);
+}
+
+void* realloc(void* pointer, size_t size) {
+  atomic_fetch_add_explicit(&allocations, 1, memory_order_relaxed);
+  return __libc_realloc(pointer, size);
+}
+#endif
 
 static unsigned int SCREEN_HEIGHT = 24;
+static bool SCREEN_HEIGHT_SET = false; // by --screen-height, not the terminal
 
 static const unsigned int OFFSET_LEFT = 10;
-static const unsigned int OFFSET_BOTTOM = 3;
+static unsigned int OFFSET_BOTTOM = 3; // and a row for every shown cell stat
 static unsigned int OFFSET_TOP;
 
 static unsigned int BAR_WIDTH = 3;
@@ -24,41 +74,1165 @@ static unsigned int VOLTS_MIN = 80;
 static unsigned int VOLTS_MAX = 150;
 static double VOLTS_STEP;
 
+// bar height of a voltage, indexed by volts - VOLTS_MIN
+struct bar_level {
+  unsigned short height;
+};
+static struct bar_level* BAR_LEVELS = NULL;
+
 static unsigned int MAX_LINE_LENGTH = 512;
 
 static const char* ALLOWED_CHARS = { "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ," };
+static const char* WHITE_SPACE_CHARS = { " \t\r\n" };
+
+// frame capacity, 0 means that it is taken from the first valid line
+static unsigned int MAX_PACKS = 0;
+static unsigned int MAX_CELLS = 0;
+
+enum char_class {
+  CHAR_INVALID = 0, CHAR_SPACE, CHAR_DIGIT, CHAR_TAG, CHAR_SEPARATOR
+};
+
+// class of every byte value, built from ALLOWED_CHARS by init_char_classes()
+static unsigned char CHAR_CLASSES[256];
+
+/*
+ * Sections of a data line. B, H, E and P repeat once per battery pack,
+ * T comes once per line.
+ */
+enum section_tag {
+  SECTION_B = 0, SECTION_H, SECTION_E, SECTION_P, SECTION_T, SECTION_TAG_COUNT,
+  SECTION_NONE = SECTION_TAG_COUNT
+};
+
+static const char SECTION_TAGS[SECTION_TAG_COUNT] = { 'B', 'H', 'E', 'P', 'T' };
+
+// section of every tag letter, built by init_char_classes()
+static unsigned char SECTION_OF_TAG[26];
+
+/*
+ * What the parser finds wrong with a line and works around, instead of
+ * rejecting the line. A section with bytes outside ALLOWED_CHARS takes the
+ * values of the same section of the previous frame, a pack whose B tag was
+ * lost starts where its sections start again, a section whose tag was lost
+ * gets its values back from the section before it, and a line that ends
+ * before its T section or starts after its first B is made up from the
+ * previous frame. Cells that jump further than MAX_CELL_STEP keep their
+ * value of the previous frame.
+ */
+enum parse_error {
+  PARSE_BAD_BYTE, // bytes outside ALLOWED_CHARS
+  PARSE_SALVAGED, // damaged sections from the previous frame
+  PARSE_DROPPED, // damaged sections the previous frame did not have
+  PARSE_LOST_TAG, // packs and sections that lost their tag
+  PARSE_TRUNCATED, // lines that ended early
+  PARSE_OUT_OF_RANGE, // cells far from, not in or lost from the last frame
+  PARSE_ERROR_COUNT
+};
+
+static const char* PARSE_ERROR_NAMES[PARSE_ERROR_COUNT] = { "Bad bytes",
+    "Salvaged", "Dropped", "Lost tags", "Truncated", "Out of range" };
+
+// cells that change more than this between frames are counted, 0 for none
+static int MAX_CELL_STEP = 20;
+// frames a pack keeps its last B cells before their change is taken as real
+#define MAX_HELD_FRAMES 5
+
+/*
+ * Statistics of every cell that the reader keeps and frames carry: the
+ * deviation from the mean of its pack, a moving average and the rate of
+ * change, all in the units of the values. They can be shown in rows under
+ * the bars.
+ */
+enum cell_stat {
+  CELL_DEVIATION, CELL_AVERAGE, CELL_RATE, CELL_STAT_COUNT
+};
+
+static const char* CELL_STAT_NAMES[CELL_STAT_COUNT] = { "deviation",
+    "ewma", "rate" };
+static const char* CELL_STAT_LABELS[CELL_STAT_COUNT] = { "Dev V:",
+    "EWMA V:", "V/min:" };
+
+// time constant of the moving average and of the rate, in seconds
+#define CELL_AVERAGE_SECONDS 60
+// columns of a cell stat on the screen, as in -1.25
+#define CELL_STAT_WIDTH 5
+
+// bits of the cell stats that --cell-stats and the 'c' key show
+static unsigned int CELL_STATS = (1 << CELL_STAT_COUNT) - 1;
+static unsigned int SHOWN_CELL_STATS = 0;
+
+// values of one tag for all packs of a frame, pack after pack
+struct section {
+  unsigned int count;
+  unsigned int capacity;
+  int* values;
+};
+
+// where the values of a pack are in the sections of its frame
+struct pack {
+  unsigned int offset[SECTION_TAG_COUNT];
+  unsigned int count[SECTION_TAG_COUNT];
+  unsigned int held; // frames in a row its B cells kept their last values
+};
+
+/*
+ * One parsed data line. Packs and section values live in one block that is
+ * allocated by alloc_frame() and reused for every line.
+ */
+struct frame {
+  unsigned int pack_count;
+  unsigned int pack_capacity;
+  unsigned int value_capacity; // per section of a pack
+  bool truncated; // packs or values were dropped, they did not fit
+  int64_t timestamp; // when the line was read, in microseconds since the epoch
+  struct pack* packs;
+  struct section sections[SECTION_TAG_COUNT];
+  unsigned char* alarms; // alarm level of every B value, set by the reader
+  float* cell_stats[CELL_STAT_COUNT]; // of every B value, set by the reader
+  uint64_t number; // of the frame in its source, from 1
+  unsigned int errors[PARSE_ERROR_COUNT]; // in the line of the frame
+};
+
+/*
+ * Binary capture files start with a header that gives the layout of the
+ * frames (all numbers are little endian):
+ *
+ *   "BMON", u16 version, u16 pack count,
+ *   u16 B, H, E and P value counts of every pack, u16 T value count
+ *
+ * and go on with fixed width frames: u64 timestamp in microseconds since the
+ * epoch and the u16 values of every pack and section in header order. Values
+ * a frame does not have are stored as CAPTURE_MISSING.
+ */
+#define CAPTURE_MAGIC "BMON"
+#define CAPTURE_VERSION 1
+#define CAPTURE_MISSING 0xFFFF
+
+struct capture_layout {
+  unsigned int pack_count;
+  unsigned int* counts; // SECTION_T counts of every pack, then the T count
+  unsigned int value_count; // of a whole frame
+};
+
+/*
+ * Frames published with --publish describe themselves, one per UDP datagram
+ * or one per message of a TCP stream (all numbers are little endian):
+ *
+ *   u32 length of the rest, on TCP only
+ *   "BMNF", u16 version, u16 source, u32 sequence number of the source,
+ *   u64 timestamp in microseconds since the epoch, u16 pack count,
+ *   u16 B, H, E and P value counts of every pack, u16 T value count,
+ *   the u16 values of every pack and section in that order
+ *
+ * A collector sees lost datagrams as gaps in the sequence numbers.
+ */
+#define NETWORK_MAGIC "BMNF"
+#define NETWORK_VERSION 1
+// the u32 length, and the header from the magic to the pack count
+#define NETWORK_LENGTH_SIZE 4
+#define NETWORK_HEADER_SIZE 22
+
+/*
+ * --export writes a file of columns, for tools that read a few values of
+ * many frames (all numbers are little endian, varints are LEB128 of the
+ * zigzag encoded number):
+ *
+ *   "BMCF", u16 version, u16 pack count,
+ *   u16 B, H, E and P value counts of every pack, u16 T value count,
+ *   u16 column count, then the name of every column as u8 length and text:
+ *   "time", "pack1.B1" and on through the values of every pack in header
+ *   order, then "T1" and on
+ *
+ * and goes on with row groups of up to EXPORT_GROUP_ROWS frames:
+ *
+ *   u32 row count, then for every column u32 length in bytes and the varint
+ *   differences of its values from the one before, the first from 0
+ *
+ * A reader skips the columns it does not need by their lengths. Frames are
+ * in the layout of the first one, as in a capture: values a frame does not
+ * have are CAPTURE_MISSING and times are microseconds since the epoch.
+ */
+#define EXPORT_MAGIC "BMCF"
+#define EXPORT_VERSION 1
+#define EXPORT_GROUP_ROWS 65536
+
+/*
+ * Files that are not followed can be jumped around in with --start-at and
+ * the Home, End, Page Up and Page Down keys. Every INDEX_STRIDE-th frame is
+ * indexed with its offset and counter time, so a jump takes a binary search
+ * and at most INDEX_STRIDE - 1 frames parsed. The index is built on the first
+ * jump and kept next to the file as FILE.index, which is used again while the
+ * file has the same size and modification time (all numbers are little
+ * endian):
+ *
+ *   "BMIX", u16 version, u16 stride, u64 file size, u64 modification time in
+ *   nanoseconds, u64 frame count, u32 entry count, u32 flags,
+ *   then for every entry u64 frame number, u64 offset and u64 counter time
+ *   in microseconds
+ *
+ * The counters wrap, a time is searched for in the index only while their
+ * time never goes down in the file, see INDEX_ORDERED.
+ */
+#define INDEX_MAGIC "BMIX"
+#define INDEX_VERSION 2
+#define INDEX_STRIDE 1024
+#define INDEX_HEADER_SIZE 40
+#define INDEX_ENTRY_SIZE 24
+#define INDEX_ORDERED 1 // flag of counter times that never go down
+
+struct index_entry {
+  uint64_t frame;
+  uint64_t offset;
+  int64_t time; // of the counters, see counter_time()
+};
+
+struct file_index {
+  struct index_entry* entries; // NULL until the first jump
+  unsigned int count;
+  unsigned int capacity;
+  uint64_t frame_count;
+  bool ordered; // the counter times never go down in the file
+};
+
+// what the screen asks the reader of a file to jump to
+enum jump {
+  JUMP_NONE, JUMP_START_AT, JUMP_FIRST, JUMP_BACK, JUMP_FORWARD, JUMP_LAST
+};
+
+// Page Up and Page Down jump by this part of the frames of the file
+#define JUMP_FRACTION 20
+
+static uint64_t START_AT_FRAME = 0; // by --start-at, 0 for from the start
+static int64_t START_AT_TIME = -1; // counter time, by --start-at=[[H:]M:]S
 
 static unsigned int FRAME_INTERVAL = 0;
 
+/*
+ * What the reader paces frames by: nothing, FRAME_INTERVAL, the time stamps
+ * of a capture or live input, or the seconds, minutes and hours counters
+ * that are the first T values.
+ */
+enum pace_source {
+  PACE_NONE, PACE_INTERVAL, PACE_TIMESTAMPS, PACE_COUNTERS
+};
+
+static enum pace_source PACE = PACE_NONE;
+static double SPEED = 1; // replay speed factor, 0 for as fast as possible
+
+static bool BENCHMARK = false;
+
+// --generate writes lines like a charger's to SOURCE or stdout instead
+static bool GENERATE = false;
+static unsigned int GENERATE_PACKS = 2;
+static unsigned int GENERATE_CELLS = 6;
+static unsigned int GENERATE_NOISE = 2; // most a cell jumps, in 0.1 volts
+static unsigned int GENERATE_ERRORS = 0; // percent of lines damaged
+static unsigned int GENERATE_RATE = 10; // frames/s, 0 for as fast as possible
+static unsigned int GENERATE_FRAMES = 0; // 0 for until stopped
+
+// lines are written in blocks of this at full speed, in bytes
+#define GENERATE_BUFFER_SIZE 65536
+
+static volatile sig_atomic_t generator_stopped = 0; // by SIGINT or SIGTERM
+static bool SHOW_STATUS = false; // the status line, toggled with 's'
+static bool PRINT_STATS = false; // the counters on stderr at exit
+// the history level on the screen, toggled with 'h', -1 for the bars
+static int SHOWN_HISTORY = -1;
+
+// gaps in the input longer than this are replayed as this, in microseconds
+#define PACE_MAX_GAP 10000000
+// when the reader is this far behind it skips ahead, in microseconds
+#define PACE_MAX_LAG 250000
+
+enum output_format {
+  OUTPUT_TEXT, OUTPUT_BINARY
+};
+
+static enum output_format OUTPUT_FORMAT = OUTPUT_TEXT;
+
+enum report_format {
+  REPORT_NONE, REPORT_TABLE, REPORT_JSON
+};
+
+static enum report_format REPORT = REPORT_NONE;
+
+// what draws the screen: curses, or escape sequences with one write a frame
+enum renderer {
+  RENDERER_CURSES, RENDERER_ANSI
+};
+
+static enum renderer RENDERER = RENDERER_CURSES;
+
+// threads that --report parses a mapped file with, 0 for one per processor
+static unsigned int JOBS = 0;
+
+// report thresholds in tenths of volts, like the data, -1 for volts-min/max
+static int LOW_VOLTS = -1;
+static int HIGH_VOLTS = -1;
+
+/*
+ * Alarm levels of a cell, ordered from low to high voltage. A cell enters
+ * a level when it crosses the threshold and leaves it only when it is back
+ * past the threshold by ALARM_HYSTERESIS.
+ */
+enum alarm_level {
+  ALARM_CRITICAL_LOW,
+  ALARM_WARNING_LOW,
+  ALARM_NORMAL,
+  ALARM_WARNING_HIGH,
+  ALARM_CRITICAL_HIGH,
+  ALARM_LEVEL_COUNT
+};
+static const char* ALARM_NAMES[ALARM_LEVEL_COUNT] = { "critical-low",
+    "warning-low", "normal", "warning-high", "critical-high" };
+static const unsigned char ALARM_COLOURS[ALARM_LEVEL_COUNT] = { COLOR_RED,
+    COLOR_YELLOW, COLOR_WHITE, COLOR_YELLOW, COLOR_RED };
+
+// alarm thresholds in decivolts, the defaults are never crossed
+#define ALARM_OFF_LOW (INT_MIN / 2)
+#define ALARM_OFF_HIGH (INT_MAX / 2)
+static int WARNING_LOW_VOLTS = ALARM_OFF_LOW;
+static int WARNING_HIGH_VOLTS = ALARM_OFF_HIGH;
+static int CRITICAL_LOW_VOLTS = ALARM_OFF_LOW;
+static int CRITICAL_HIGH_VOLTS = ALARM_OFF_HIGH;
+static int ALARM_HYSTERESIS = 1;
+static char* ALARM_HOOK = NULL;
+static int ALARM_EXIT_STATUS = 0; // 0 keeps running after critical alarms
+static unsigned int REFRESH_INTERVAL = 40 * 1000;
+
+enum fsync_policy {
+  FSYNC_NEVER, FSYNC_INTERVAL, FSYNC_EVERY
+};
+
+static enum fsync_policy FSYNC_POLICY = FSYNC_NEVER;
+static unsigned int FSYNC_INTERVAL_MS = 1000;
+
 static char* OUTPUT_FILE = NULL;
+static char* EXPORT_FILE = NULL; // by --export, instead of the screen
+static char* PUBLISH = NULL; // udp:HOST:PORT or tcp:HOST:PORT
+
+// the SOURCEs of --config files, then of the command line
+static char** SOURCE_PATHS = NULL;
+static unsigned int SOURCE_PATH_COUNT = 0;
+// the other values of --config files, which the options point into
+static char** CONFIG_VALUES = NULL;
+static unsigned int CONFIG_VALUE_COUNT = 0;
+
+// the options of the command line and of --config files, by name
+static const struct option OPTIONS[] = {
+    { "screen-height", 1, 0, 1 },
+    { "bar-width", 1, 0, 2 },
+    { "space-between-bars", 1, 0, 3 },
+    { "volts-min", 1, 0, 4 },
+    { "volts-max", 1, 0, 5 },
+    { "max-line-length", 1, 0, 6 },
+    { "frame-interval", 1, 0, 7 },
+    { "pace", 1, 0, 30 },
+    { "speed", 1, 0, 31 },
+    { "benchmark", 0, 0, 32 },
+    { "status", 0, 0, 33 },
+    { "stats", 0, 0, 34 },
+    { "publish", 1, 0, 35 },
+    { "history", 0, 0, 36 },
+    { "start-at", 1, 0, 37 },
+    { "cell-stats", 2, 0, 38 },
+    { "export", 1, 0, 39 },
+    { "renderer", 1, 0, 40 },
+    { "max-cell-step", 1, 0, 41 },
+    { "output-file", 1, 0, 8 },
+    { "help", 0, 0, 9 },
+    { "max-packs", 1, 0, 10 },
+    { "max-cells", 1, 0, 11 },
+    { "follow", 0, 0, 12 },
+    { "device", 1, 0, 13 },
+    { "baud", 1, 0, 14 },
+    { "refresh-interval", 1, 0, 15 },
+    { "fsync", 1, 0, 16 },
+    { "fsync-interval", 1, 0, 17 },
+    { "output-format", 1, 0, 18 },
+    { "report", 2, 0, 19 },
+    { "low-volts", 1, 0, 20 },
+    { "high-volts", 1, 0, 21 },
+    { "jobs", 1, 0, 22 },
+    { "warning-low", 1, 0, 23 },
+    { "warning-high", 1, 0, 24 },
+    { "critical-low", 1, 0, 25 },
+    { "critical-high", 1, 0, 26 },
+    { "hysteresis", 1, 0, 27 },
+    { "alarm-hook", 1, 0, 28 },
+    { "alarm-exit", 1, 0, 29 },
+    { "config", 1, 0, 42 },
+    { "generate", 0, 0, 43 },
+    { "generate-packs", 1, 0, 44 },
+    { "generate-cells", 1, 0, 45 },
+    { "generate-noise", 1, 0, 46 },
+    { "generate-errors", 1, 0, 47 },
+    { "generate-rate", 1, 0, 48 },
+    { "generate-frames", 1, 0, 49 },
+    { 0, 0, 0, 0 }
+};
+
+static bool FOLLOW = false;
+// how often a followed file is checked for rotation, in milliseconds
+static const int FOLLOW_POLL_INTERVAL = 500;
+
+static char* DEVICE = NULL;
+static unsigned int BAUD = 9600;
+
+static const size_t READ_BUFFER_SIZE = 64 * 1024;
+
+enum read_status {
+  READ_LINE, READ_EOF
+};
+
+/*
+ * Reads lines from a file descriptor into one buffer. Lines are returned in
+ * place, terminated with '\0' instead of '\n'. When following, a partial
+ * line at the end of the file is kept until the rest of it is written.
+ */
+struct line_reader {
+  char* path;
+  int fd;
+  off_t offset; // bytes read from the file so far
+
+  char* buffer;
+  size_t size;
+  size_t start; // first byte not returned yet
+  size_t end; // end of the data in the buffer
+
+  char* repeat_line; // returned again by the next read_line()
+
+  // character replaced by '\0' when a too long line was split
+  size_t split_position;
+  char split_char;
+
+  bool follow;
+  bool device; // a serial port, read without blocking
+  bool stream; // a socket, its input ends when the other side closes it
+  bool binary; // a capture file, read frame by frame
+  struct capture_layout layout;
+
+  // a regular file mapped into memory, its lines are parsed where they are
+  const char* map;
+  size_t map_size;
+  size_t map_offset;
+  int inotify_fd;
+  int watch;
+};
+
+#define FRAME_RING_SIZE 16
+
+/*
+ * Frames passed from the reader thread to the screen, without locks. The
+ * reader fills frames[head % FRAME_RING_SIZE] and moves head, the screen
+ * draws the newest frame and moves tail past everything it has skipped.
+ * When the ring is full the reader parses into one of the two spare frames
+ * after the ring. A spare is dropped if another frame follows it, otherwise
+ * it is swapped into the ring once there is room, so the last frame always
+ * shows. There are two spares so that a line that turns out to be invalid
+ * does not overwrite the frame that is waiting.
+ */
+struct frame_ring {
+  struct frame frames[FRAME_RING_SIZE + 2];
+  struct frame* pending; // NULL, or the spare with the newest frame
+  atomic_uint head;
+  atomic_uint tail;
+  atomic_bool ready; // frames have been allocated
+  atomic_bool finished; // the reader has reached the end of the input
+  atomic_ulong dropped;
+};
+
+#define LOG_RING_SIZE (1024 * 1024)
+#define LOG_BUFFER_ALIGNMENT 4096
+
+// how long the log thread lets lines pile up before writing, in microseconds
+static const unsigned int LOG_BATCH_INTERVAL = 10 * 1000;
+// how often it looks at the ring meanwhile, in microseconds
+static const unsigned int LOG_POLL_INTERVAL = 1000;
+
+/*
+ * Lines passed from the reader thread to the log thread, without locks, so
+ * that a slow disk does not hold up reading or drawing. The log thread
+ * writes everything that has piled up with one writev(). A disk that falls a
+ * whole ring behind loses records, the reader never waits for it.
+ */
+struct log_ring {
+  int fd;
+  enum output_format format;
+  bool has_layout; // the capture header has been written or read
+  struct capture_layout layout;
+  unsigned char* record; // one binary frame
+  size_t record_size; // 0 for text, where records end with a newline
+  size_t header_size;
+  char* buffer; // LOG_RING_SIZE bytes, aligned to LOG_BUFFER_ALIGNMENT
+  atomic_size_t head;
+  atomic_size_t tail;
+  atomic_bool finished;
+
+  atomic_ulong bytes_written;
+  atomic_ulong records_written;
+  atomic_ulong records_dropped;
+};
+
+#define NETWORK_RING_SIZE (1024 * 1024)
+// frames sent with one sendmmsg()
+#define NETWORK_BATCH 64
+// how long the network thread lets frames pile up, in microseconds
+#define NETWORK_BATCH_INTERVAL (10 * 1000)
+// time between attempts to connect to a TCP collector, in milliseconds
+#define NETWORK_RECONNECT_INTERVAL 1000
+
+/*
+ * Frames passed from the reader thread to the network thread, without locks,
+ * each with its u32 length in front, as TCP sends them. A collector that
+ * falls behind loses frames, the reader never waits for the network.
+ */
+struct network_output {
+  char* spec; // udp:HOST:PORT or tcp:HOST:PORT
+  bool datagrams;
+  int fd; // -1 while a TCP collector is unreachable
+  unsigned char* frame; // the frame being queued
+  size_t frame_size;
+  unsigned char* buffer; // NETWORK_RING_SIZE bytes
+  size_t frame_end; // of the frame TCP is sending, in ring bytes
+  atomic_size_t head;
+  atomic_size_t tail;
+  atomic_bool finished;
+
+  atomic_ulong frames_sent;
+  atomic_ulong bytes_sent;
+  atomic_ulong frames_dropped;
+};
+
+// alarm state of the cells, kept by the reader thread
+struct alarms {
+  unsigned int capacity;
+  unsigned char* levels; // current level of every cell
+  bool critical; // a cell went critical
+  posix_spawn_file_actions_t hook_actions; // detaches --alarm-hook commands
+  const char* source; // passed to --alarm-hook
+};
+
+// schedule of the reader on the monotonic clock, see pace_frame()
+struct pacer {
+  bool started;
+  int64_t input_time; // of the last frame, in microseconds
+  long long due; // monotonic time the last frame was due, in microseconds
+};
+
+/*
+ * History of the cells in HISTORY_BUCKETS buckets of every span, so that a sag
+ * between two glances at the screen still shows. A bucket keeps the min, max
+ * and sum of the samples in it instead of the samples, a sample is added to
+ * one bucket of each span.
+ */
+#define HISTORY_LEVELS 3
+#define HISTORY_BUCKETS 240
+static const unsigned int HISTORY_SPANS[HISTORY_LEVELS] = { 1, 60, 3600 };
+static const char* HISTORY_NAMES[HISTORY_LEVELS] = { "second", "minute",
+    "hour" };
+// shows the lowest voltage of a bucket, from the bottom of the scale up
+static const char HISTORY_RAMP[] = "_.-~=+*#";
+
+struct history_bucket {
+  int min;
+  int max;
+  int64_t sum;
+  uint32_t count; // 0 for a bucket without samples
+};
+
+// the reader thread adds frames, the screen draws from it
+struct history {
+  unsigned int capacity;
+  struct history_bucket* buckets; // by level, then bucket, then cell
+  int64_t newest[HISTORY_LEVELS]; // bucket number, timestamp seconds / span
+  pthread_mutex_t lock;
+};
+
+/*
+ * Moving averages and rates of the cells, kept by the reader thread. They
+ * are arrays by cell, pack after pack like the B section, so that a pack is
+ * updated in one loop without branches.
+ */
+struct cell_stats {
+  unsigned int capacity;
+  unsigned int count; // cells of the last frame, the stats restart if it changes
+  float* averages;
+  float* rates; // per minute
+  bool started;
+  int64_t time; // of the last frame, see cell_stats_time()
+};
+
+// what the reader thread works on
+struct ingest {
+  struct line_reader reader;
+  struct alarms alarms;
+  struct pacer pacer;
+  struct history history;
+  struct cell_stats cell_stats;
+  struct frame_ring* frames;
+  struct log_ring* log; // NULL without --output-file
+  struct network_output* network; // NULL without --publish
+  unsigned int index; // of the source, in published frames
+  uint32_t sequence; // of the last published frame
+  bool keep_text; // read_frame() returns the text of frames, for a text log
+  char* text; // text of a frame, when there is no line to change
+  size_t text_size;
+
+  uint64_t frame_number; // of the last frame read
+  struct frame previous; // the last frame parsed, for repairing the next one
+  atomic_int jump; // enum jump, set by the screen
+  bool jumped; // by a key, the file then waits at its end for more jumps
+  struct file_index file_index;
+
+  // one of several sources that read_sources() reads without blocking
+  bool multiplexed;
+  struct frame* held; // read, but not due yet
+  bool finished;
+};
+
+/*
+ * A source on the screen, with its newest cells for switching to it and for
+ * the summary. Only the screen uses the fields after ingest.
+ */
+struct source {
+  char* name;
+  struct ingest ingest;
+
+  unsigned long frames;
+  unsigned int pack_count;
+  unsigned int cell_count;
+  unsigned int cell_capacity;
+  int* volts;
+  unsigned char* levels;
+  float* cell_stats; // CELL_STAT_COUNT rows of cell_capacity
+  enum alarm_level level; // the worst level of a cell
+  long long updated_ms;
+};
+
+// the summary of all sources, shown instead of the bars of one source
+#define SOURCE_SUMMARY -1
+
+// frames that read_sources() reads from one source before the next one
+#define SOURCE_BATCH 64
+#define SOURCE_EVENTS 16
+
+// statistics of one value over a whole capture, kept exact in integers
+struct value_stats {
+  unsigned long long count;
+  long long sum;
+  unsigned long long sum_squares;
+  int min;
+  int max;
+  unsigned long long below; // values below LOW_VOLTS
+  unsigned long long above; // values above HIGH_VOLTS
+};
+
+/*
+ * Statistics of every cell and of the imbalance (max - min of the cells in a
+ * frame) of every pack, gathered in one pass with --report.
+ */
+struct report {
+  unsigned int pack_capacity;
+  unsigned int cell_capacity; // per pack
+  unsigned long long frames;
+  struct value_stats* cells; // cell_capacity cells of every pack
+  struct value_stats* imbalance; // of every pack
+};
+
+// a row group of --export, with the values of every column one after another
+struct export {
+  int fd;
+  struct capture_layout layout;
+  unsigned char* record; // a frame in the layout
+  unsigned int rows;
+  int64_t* times;
+  uint16_t* values; // EXPORT_GROUP_ROWS of every column
+  unsigned char* column; // an encoded column
+  unsigned long frames;
+  unsigned long groups;
+  unsigned long long bytes;
+};
+
+/*
+ * A newline aligned part of a mapped file, reported on by its own thread.
+ * Lines are repaired from the previous frame as when reading the file in one
+ * thread, so the chunk starts from a seed, the frame of the lines before it.
+ */
+struct report_chunk {
+  const char* begin;
+  const char* end;
+  const char* warmup; // where the lines that make the seed start
+  struct frame frame;
+  struct frame previous;
+  bool has_previous;
+  struct frame seed;
+  bool has_seed;
+  struct report report;
+};
+
+// lines before a chunk that its seed is parsed from
+#define REPORT_WARMUP_LINES 16
+
+// input of the benchmark, kept in memory with what each stage needs of it
+struct benchmark_input {
+  char name[32];
+  char* data; // lines
+  size_t size;
+  unsigned long line_count;
+  unsigned long frame_count;
+  char* text; // lines of the frames without white space, '\0' terminated
+  size_t* text_offsets;
+  int* cells; // B values of the frames
+  size_t* cell_offsets; // frame_count + 1 of them
+  unsigned int max_cells;
+  size_t max_line_length;
+};
+
+// time and heap allocations of one benchmark stage
+struct benchmark_clock {
+  long long start_ns;
+  long long end_ns;
+  long long allocations; // -1 if the build does not count them
+};
+
+// bar heights that are on the screen, so that only the changed rows are drawn
+static unsigned int* drawn_heights = NULL;
+static unsigned char* drawn_colours = NULL;
+static int* drawn_volts = NULL; // clamped, for redrawing after a resize
+
+/*
+ * Width and spacing of the bars on the screen. They are BAR_WIDTH and
+ * SPACE_BETWEEN_BARS unless the bars do not fit the terminal, and then
+ * shown_bar_count bars from first_bar are on the screen.
+ */
+static unsigned int drawn_bar_width;
+static unsigned int drawn_bar_space;
+static unsigned int first_bar = 0;
+static unsigned int shown_bar_count = 0;
+
+// rows of bar_y() from position -1, and columns of the shown bars for bar_x()
+static int* bar_rows = NULL;
+static int* bar_columns = NULL;
+
+static volatile sig_atomic_t screen_resized = 0;
+
+// a character of the ANSI screen, with a colour pair and ANSI_ bits
+struct ansi_cell {
+  char text;
+  unsigned char style;
+};
+
+#define ANSI_COLOUR 0x07
+#define ANSI_BOLD 0x08
+#define ANSI_REVERSE 0x10
+// the most a changed cell takes: a cursor move, a style and the character
+#define ANSI_CELL_BYTES 32
+// and the resets and the cursor move of a frame
+#define ANSI_FRAME_BYTES 64
+// the longest text printed in one go, the rest is cut off
+#define ANSI_TEXT_SIZE 512
+// the size of a screen that is not a terminal, as curses has it
+#define ANSI_LINES 24
+#define ANSI_COLUMNS 80
+// the alternate screen, and back
+#define ANSI_START "\x1b[?1049h\x1b[H\x1b[2J"
+#define ANSI_STOP "\x1b[0m\x1b[?1049l"
+
+/*
+ * The screen of --renderer=ansi: the cells that are drawn, the cells that
+ * the terminal shows, and the frame of escape sequences between the two.
+ */
+struct ansi_screen {
+  int fd;
+  bool terminal;
+  bool started;
+  bool termios_set;
+  struct termios saved_termios;
+  int lines;
+  int columns;
+  struct ansi_cell* cells;
+  struct ansi_cell* shown;
+  bool* lines_changed; // the lines that refresh_ansi() compares
+  bool cleared; // by screen_clear(), for the terminal on the next frame
+  bool changed; // since the last frame
+  int y, x; // the cursor
+  unsigned char style;
+  char* out;
+  size_t out_capacity;
+  unsigned char keys[64]; // read and not yet returned
+  unsigned int key_count;
+  int unread_key;
+};
+
+static struct ansi_screen ansi = { .fd = -1 };
+
+// the sources, and the one whose bars are shown
+static struct source* sources = NULL;
+static unsigned int source_count = 0;
+static int shown_source = 0;
+static volatile sig_atomic_t stats_requested = 0;
+
+/*
+ * Counters of the hot paths, always on. Each one has a single writer, the
+ * reader thread or the screen, so they are added to without locked
+ * instructions.
+ */
+struct stats {
+  atomic_ullong lines_read;
+  atomic_ullong lines_rejected; // by the parser
+  atomic_ullong parse_errors[PARSE_ERROR_COUNT]; // in lines it kept
+  atomic_ullong frames_read;
+  atomic_ullong parse_ns;
+  atomic_ullong frames_drawn;
+  atomic_ullong draw_ns;
+  atomic_ullong refresh_ns;
+};
+
+static struct stats stats;
+
+// the counters at one time, with what the frame ring and the log count
+struct stats_snapshot {
+  long long time_ms;
+  unsigned long long lines_read;
+  unsigned long long lines_rejected;
+  unsigned long long parse_errors[PARSE_ERROR_COUNT];
+  unsigned long long frames_read;
+  unsigned long long parse_ns;
+  unsigned long long frames_drawn;
+  unsigned long long draw_ns;
+  unsigned long long refresh_ns;
+  unsigned long long frames_dropped;
+  unsigned long long bytes_written;
+};
+
+// time between status line updates, in milliseconds
+#define STATUS_INTERVAL 1000
+static unsigned int drawn_bar_count = 0;
+static unsigned int drawn_bar_capacity = 0;
 
 // Functions
 void init_screen();
 void finish_screen(int sig);
 void finish_screen_and_exit(int sig);
+void screen_move(int y, int x);
+void screen_print(const char* format, ...);
+void screen_print_at(int y, int x, const char* format, ...);
+void screen_text_at(int y, int x, const char* text, int length);
+void screen_char(int c);
+void screen_char_at(int y, int x, int c);
+void screen_fill(int y, int x, chtype fill, int count);
+void screen_attr_on(int attr);
+void screen_attr_off(int attr);
+void screen_clear_line();
+void screen_clear();
+void screen_redraw();
+void screen_refresh();
+int screen_lines();
+int screen_columns();
+int screen_key(bool wait);
+void screen_unread_key(int key);
+void start_ansi(int fd, bool terminal);
+void stop_ansi();
+void size_ansi(int lines, int columns);
+void put_ansi(const char* text, size_t length);
+unsigned char ansi_style(unsigned char style, int attr, bool on);
+void refresh_ansi();
+size_t put_ansi_style(char* out, unsigned char style);
+void write_ansi(const char* data, size_t size);
+int read_ansi_key(bool wait);
 int bar_y(unsigned int positions_up_from_bottom);
 int bar_x(unsigned int bar_position, unsigned int bar_width);
+int bottom_line_y();
 void move_cursor_to_bottom_line();
 void print_left_panel();
 void print_bottom_panel(int battery_count);
-void print_battery_bars(unsigned int battery_size, int batteries[]);
-//void print_status_message(char * message);
+void print_battery_bars(const struct frame* frame);
+void print_bar_rows(unsigned int bar, unsigned int from, unsigned int to,
+    chtype fill);
+chtype bar_fill(unsigned char colour);
+void set_drawn_bar_count(unsigned int bar_count);
+bool set_bar_geometry(unsigned int bar_count);
+bool bar_shown(unsigned int bar);
+void print_all_bars();
+int cell_stat_y(enum cell_stat stat);
+void print_cell_stats(const struct source* source);
+bool switch_cell_stats(int key);
+bool scroll_bars(int key);
+bool handle_key(int key);
+void read_keys();
+void handle_resize(int sig);
+void handle_stats_request(int sig);
+void resize_screen();
+void wait_for_key();
+void set_screen_layout();
+bool switch_source(int key);
+void show_source(int index);
+void print_tabs();
+void print_summary();
+void print_summary_line(int y, const struct source* source, int low,
+    int high);
+bool switch_history(int key);
+void print_history(struct source* source);
+void print_history_line(int y, const struct history_bucket* buckets,
+    unsigned int width, unsigned int cell, unsigned int capacity,
+    unsigned int oldest);
+void remember_frame(struct source* source, const struct frame* frame);
+unsigned int alarm_severity(enum alarm_level level);
+bool sources_finished();
+void print_status_message(char* message);
+void add_stat(atomic_ullong* counter, unsigned long long value);
+void count_line(bool valid, long long start_ns);
+void count_parse_errors(const struct frame* frame);
+void take_stats(struct stats_snapshot* snapshot);
+void print_stats(FILE* file, const struct stats_snapshot* snapshot);
+void update_status_line(bool force);
+void dump_stats();
 int round_to_int(double x);
+unsigned int bar_height(int volts);
+void set_bar_levels();
 void set_options(int argc, char** argv);
+bool set_option(int option, char* value);
+void read_config(const char* file_name);
+char* trim(char* text);
+void add_text(char*** texts, unsigned int* count, char* text);
+bool parse_number(const char* text, int min, int max, int* number);
+bool parse_factor(const char* text, double* factor);
 FILE* open_file(char* fileName, char* mode);
 void close_file(FILE* file);
-void read_voltages(char line[], int* voltages);
-bool is_valid_line(char line[]);
+void init_reader(struct line_reader* reader, char* path);
+void open_reader(struct line_reader* reader, char* path, bool follow);
+void open_device_reader(struct line_reader* reader, char* path,
+    unsigned int baud);
+speed_t baud_to_speed(unsigned int baud);
+void open_socket_reader(struct line_reader* reader, char* spec);
+void open_source(struct ingest* ingest, char* path);
+void close_reader(struct line_reader* reader);
+int read_line(struct line_reader* reader, char** line);
+ssize_t fill_reader(struct line_reader* reader);
+int read_mapped_line(struct line_reader* reader, const char** begin,
+    const char** end);
+void map_reader(struct line_reader* reader, size_t size);
+int read_capture_frame(struct line_reader* reader, struct frame* frame);
+void wait_for_data(struct line_reader* reader);
+void drain_events(struct line_reader* reader);
+void check_followed_file(struct line_reader* reader);
+int source_fd(const struct line_reader* reader);
+void reopen_reader(struct line_reader* reader);
+bool reader_seekable(const struct line_reader* reader);
+uint64_t reader_position(const struct line_reader* reader);
+void set_reader_position(struct line_reader* reader, uint64_t position);
+int read_indexed_frame(struct line_reader* reader, struct frame* frame);
+void load_file_index(struct ingest* ingest, struct frame* frame);
+bool read_file_index(struct file_index* index, const char* path,
+    const struct stat* st);
+uint64_t modification_time(const struct stat* st);
+void write_file_index(const struct file_index* index, const char* path,
+    const struct stat* st);
+void build_file_index(struct ingest* ingest, struct frame* frame);
+void add_index_entry(struct file_index* index, uint64_t frame,
+    uint64_t offset, int64_t time);
+void jump(struct ingest* ingest, struct frame* frame);
+void seek_frame(struct ingest* ingest, struct frame* frame, uint64_t number,
+    int64_t time);
+void wait_for_jump(struct ingest* ingest);
+bool request_jump(int key);
+bool parse_start_at(const char* value);
+bool parse_cell_stats(const char* value);
+void watch_file(struct line_reader* reader);
+void init_char_classes();
+bool measure_line(const char* begin, const char* end,
+    unsigned int* pack_count, unsigned int* value_count);
+bool alloc_frames_for_line(struct frame* frames, unsigned int count,
+    const char* begin, const char* end);
+void alloc_frames(struct frame* frames, unsigned int count,
+    unsigned int pack_count, unsigned int value_count);
+void alloc_frame(struct frame* frame, unsigned int pack_capacity,
+    unsigned int value_capacity);
+void free_frame(struct frame* frame);
+bool alloc_input_frames(struct ingest* ingest, struct frame* frames,
+    unsigned int count);
+int read_frame(struct ingest* ingest, struct frame* frame, char** text);
+const struct frame* previous_frame(struct ingest* ingest,
+    const struct frame* frame);
+void* read_frames(void* arg);
+void deliver_frame(struct ingest* ingest, struct frame* frame, char* text);
+long long read_source(struct ingest* ingest);
+void finish_source(struct ingest* ingest);
+void* read_sources(void* arg);
+char* reserve_text(struct ingest* ingest, size_t size);
+struct frame* next_free_frame(struct frame_ring* ring);
+void publish_frame(struct frame_ring* ring, struct frame* frame);
+void publish_spare_frame(struct frame_ring* ring);
+const struct frame* newest_frame(struct frame_ring* ring, unsigned int* head);
+void release_frames(struct frame_ring* ring, unsigned int head);
+void open_log(struct log_ring* log, char* file_name);
+bool log_line(struct log_ring* log, const char line[]);
+void log_frame(struct log_ring* log, const char line[],
+    const struct frame* frame);
+bool log_room(struct log_ring* log, size_t length);
+void log_bytes(struct log_ring* log, const void* data, size_t length);
+void* write_log(void* arg);
+void wait_for_log(struct log_ring* log, size_t tail);
+void sync_log(struct log_ring* log);
+void open_network_output(struct network_output* output, char* spec);
+int connect_network_output(const struct network_output* output);
+size_t encode_network_frame(const struct frame* frame, unsigned int source,
+    uint32_t sequence, unsigned char* out);
+void queue_network_frame(struct network_output* output,
+    const struct frame* frame, unsigned int source, uint32_t sequence);
+void* send_network_frames(void* arg);
+size_t send_datagrams(struct network_output* output, size_t tail,
+    size_t head);
+ssize_t send_stream(struct network_output* output, size_t tail, size_t head);
+uint32_t get_u32_at(const unsigned char* ring, size_t size, size_t offset);
+long long monotonic_ms();
+long long monotonic_us();
+long long monotonic_ns();
+int64_t frame_input_time(const struct frame* frame);
+int64_t counter_time(const struct frame* frame);
+bool schedule_frame(struct pacer* pacer, const struct frame* frame);
+void pace_frame(struct pacer* pacer, const struct frame* frame);
+bool parse_frame(char line[], struct frame* frame,
+    const struct frame* previous);
+bool parse_frame_range(const char* begin, const char* end, char* out,
+    struct frame* frame, const struct frame* previous);
+bool start_pack(struct frame* frame);
+void repair_section(struct frame* frame, const struct frame* previous,
+    unsigned int section, unsigned int start);
+bool copy_section(struct frame* frame, const struct frame* previous,
+    unsigned int section);
+void complete_frame(struct frame* frame, const struct frame* previous,
+    unsigned int section, unsigned int start, unsigned int seen);
+void insert_packs(struct frame* frame, const struct frame* previous,
+    unsigned int count);
+void repair_lost_tags(struct frame* frame, const struct frame* previous);
+void insert_values(struct frame* frame, unsigned int pack,
+    unsigned int section, const int* from, unsigned int count);
+void cut_section(struct frame* frame, unsigned int pack,
+    unsigned int section, unsigned int count);
+void check_cell_steps(struct frame* frame, const struct frame* previous);
+void copy_frame(struct frame* to, const struct frame* from);
+const int* pack_values(const struct frame* frame, unsigned int pack,
+    enum section_tag tag, unsigned int* count);
+size_t format_frame_line(const struct frame* frame, char line[]);
+size_t max_frame_line_length(unsigned int pack_count, unsigned int value_count);
+int64_t realtime_us();
+void layout_from_frame(struct capture_layout* layout,
+    const struct frame* frame);
+void alloc_layout(struct capture_layout* layout, unsigned int pack_count);
+void free_layout(struct capture_layout* layout);
+unsigned int layout_max_count(const struct capture_layout* layout);
+size_t capture_header_size(const struct capture_layout* layout);
+size_t capture_record_size(const struct capture_layout* layout);
+void put_u16(unsigned char out[], unsigned int value);
+unsigned int get_u16(const unsigned char in[]);
+void put_u32(unsigned char out[], uint32_t value);
+uint32_t get_u32(const unsigned char in[]);
+void put_u64(unsigned char out[], uint64_t value);
+uint64_t get_u64(const unsigned char in[]);
+size_t encode_capture_header(const struct capture_layout* layout,
+    unsigned char out[]);
+bool read_capture_header(int fd, struct capture_layout* layout);
+void encode_capture_frame(const struct capture_layout* layout,
+    const struct frame* frame, unsigned char out[]);
+void decode_capture_frame(const struct capture_layout* layout,
+    const unsigned char in[], struct frame* frame);
+void init_report(struct report* report, unsigned int pack_capacity,
+    unsigned int cell_capacity);
+void free_report(struct report* report);
+void add_frame_to_report(struct report* report, const struct frame* frame);
+void add_value(struct value_stats* stats, int value);
+double stats_mean(const struct value_stats* stats);
+double stats_stddev(const struct value_stats* stats);
+void print_report_table(const struct report* report);
+void print_report_json(const struct report* report);
+int run_report(char* file_name);
+int run_export(char* file_name);
+void open_export(struct export* export, const struct frame* frame);
+void export_frame(struct export* export, const struct frame* frame);
+void write_export_group(struct export* export);
+size_t encode_export_column(unsigned char* out, const int64_t* times,
+    const uint16_t* values, unsigned int rows);
+size_t put_varint(unsigned char out[], int64_t value);
+void write_export(struct export* export, const void* data, size_t size);
+void free_export(struct export* export);
+void run_parallel_report(struct line_reader* reader,
+    const struct frame* frame, struct report* report, unsigned int jobs);
+void* report_chunk(void* arg);
+void report_lines(struct report_chunk* chunk, const char* begin,
+    const char* end, bool add);
+bool same_frame(const struct frame* a, const struct frame* b, bool a_set,
+    bool b_set);
+void merge_report(struct report* into, const struct report* from);
+void merge_stats(struct value_stats* into, const struct value_stats* from);
+int parse_volts(const char volts[]);
+void setup_screen();
+int run_benchmark(char* file_name);
+void load_benchmark_file(struct benchmark_input* input, char* file_name);
+void generate_benchmark_input(struct benchmark_input* input,
+    unsigned int pack_count, unsigned int cell_count, unsigned long lines);
+size_t generate_line(char* out, unsigned int* random, unsigned int pack_count,
+    unsigned int cell_count, unsigned int noise, unsigned long line,
+    unsigned long seconds);
+unsigned int next_random(unsigned int* random);
+size_t damage_line(char* line, size_t length, unsigned int* random);
+int run_generator(char* file_name);
+void stop_generator(int sig);
+bool write_generated(int fd, const char* data, size_t size);
+void prepare_benchmark_input(struct benchmark_input* input);
+void free_benchmark_input(struct benchmark_input* input);
+void benchmark_input(struct benchmark_input* input);
+void benchmark_validate(const struct benchmark_input* input);
+void benchmark_parse(const struct benchmark_input* input);
+void benchmark_bars(const struct benchmark_input* input);
+void benchmark_render(const struct benchmark_input* input);
+void benchmark_log(const struct benchmark_input* input);
+long long allocation_count();
+void start_benchmark(struct benchmark_clock* clock);
+void stop_benchmark(struct benchmark_clock* clock);
+void print_benchmark(const struct benchmark_input* input, const char stage[],
+    unsigned long records, const struct benchmark_clock* clock);
+void init_alarms(struct alarms* alarms, unsigned int capacity);
+void free_alarms(struct alarms* alarms);
+void init_history(struct history* history, unsigned int capacity);
+void free_history(struct history* history);
+void clear_history_buckets(struct history* history, unsigned int level,
+    int64_t from, int64_t to);
+void update_history(struct history* history, const struct frame* frame);
+void init_cell_stats(struct cell_stats* stats, unsigned int capacity);
+void free_cell_stats(struct cell_stats* stats);
+int64_t cell_stats_time(const struct frame* frame);
+void update_cell_stats(struct cell_stats* stats, struct frame* frame);
+void update_pack_stats(const int* restrict volts, unsigned int count,
+    float* restrict deviations, float* restrict averages,
+    float* restrict rates, float weight, float per_minute);
+enum alarm_level alarm_level(int volts, enum alarm_level level);
+void check_alarms(struct alarms* alarms, struct frame* frame);
+void run_alarm_hook(struct alarms* alarms, enum alarm_level level,
+    unsigned int cell, int volts);
 // End of functions
 
 void init_screen() {
-  initscr();
+  if (RENDERER == RENDERER_ANSI) {
+    start_ansi(STDOUT_FILENO, true);
+  } else {
+    initscr();
+  }
+  setup_screen();
+}
+
+// sets up the current screen, from init_screen() or a benchmark
+void setup_screen() {
   signal(SIGINT, finish_screen_and_exit);
-  keypad(stdscr, true);
-  nonl();
-  cbreak();
+  if (RENDERER == RENDERER_CURSES) {
+    keypad(stdscr, true);
+    nonl();
+    cbreak();
+  }
 
-  if (has_colors()) {
+  if (RENDERER == RENDERER_CURSES && has_colors()) {
     start_color();
 
     init_pair(COLOR_BLACK, COLOR_BLACK, COLOR_BLACK);
@@ -70,10 +1244,22 @@ void init_screen() {
     init_pair(COLOR_BLUE, COLOR_BLUE, COLOR_BLACK);
     init_pair(COLOR_YELLOW, COLOR_YELLOW, COLOR_BLACK);
   }
+
+  if (!SCREEN_HEIGHT_SET && screen_lines() > 0) {
+    SCREEN_HEIGHT = screen_lines();
+    set_screen_layout();
+  }
+  set_bar_geometry(0);
+  signal(SIGWINCH, handle_resize);
+  signal(SIGUSR1, handle_stats_request);
 }
 
 void finish_screen(int sig) {
-  endwin();
+  if (RENDERER == RENDERER_ANSI) {
+    stop_ansi();
+  } else {
+    endwin();
+  }
 
   if (sig != 0) {
     printf("Got signal %d\n", sig);
@@ -85,343 +1271,6760 @@ void finish_screen_and_exit(int sig) {
   exit(EXIT_SUCCESS);
 }
 
-int bar_y(unsigned int positions_up_from_bottom) {
-  return SCREEN_HEIGHT - OFFSET_BOTTOM - positions_up_from_bottom;
-}
-
-int bar_x(unsigned int bar_position, unsigned int bar_width) {
-  return 1 + OFFSET_LEFT + (SPACE_BETWEEN_BARS + BAR_WIDTH) * (bar_position) + bar_width;
+/*
+ * The drawing of the screen goes through these, to curses or to the ANSI
+ * renderer, with the curses attributes and keys for both.
+ */
+void screen_move(int y, int x) {
+  if (RENDERER == RENDERER_ANSI) {
+    ansi.y = y;
+    ansi.x = x;
+    ansi.changed = true;
+  } else {
+    move(y, x);
+  }
 }
 
-void move_cursor_to_bottom_line() {
-  move(bar_y(-2), 0);
-}
+void screen_print(const char* format, ...) {
+  va_list args;
 
-void print_left_panel() {
-  attron(COLOR_PAIR(COLOR_CYAN));
-  attron(A_BOLD);
-  mvprintw(0, OFFSET_LEFT - 6, "Volts:");
-  attroff(A_BOLD);
+  va_start(args, format);
+  if (RENDERER == RENDERER_ANSI) {
+    char text[ANSI_TEXT_SIZE];
+    int length = vsnprintf(text, sizeof(text), format, args);
 
-  int i;
-  for (i = 0; i <= OFFSET_TOP - OFFSET_BOTTOM; i += 2) {
-    mvprintw(bar_y(i), OFFSET_LEFT - 6, "%5.2f", (VOLTS_MIN + i * VOLTS_STEP)
-        / 10.0);
+    put_ansi(text, (length < (int) sizeof(text)) ? length : sizeof(text) - 1);
+  } else {
+    vw_printw(stdscr, format, args);
   }
+  va_end(args);
+}
 
-  attron(A_BOLD);
-  mvprintw(bar_y(-1), 1, "Battery:");
-  attroff(A_BOLD);
-  attroff(COLOR_PAIR(COLOR_CYAN));
+void screen_print_at(int y, int x, const char* format, ...) {
+  va_list args;
 
-  move_cursor_to_bottom_line();
+  screen_move(y, x);
+  va_start(args, format);
+  if (RENDERER == RENDERER_ANSI) {
+    char text[ANSI_TEXT_SIZE];
+    int length = vsnprintf(text, sizeof(text), format, args);
+
+    put_ansi(text, (length < (int) sizeof(text)) ? length : sizeof(text) - 1);
+  } else {
+    vw_printw(stdscr, format, args);
+  }
+  va_end(args);
 }
 
-void print_bottom_panel(int battery_count) {
-  int i;
+// prints up to length characters of the text, all of them if length is -1
+void screen_text_at(int y, int x, const char* text, int length) {
+  if (RENDERER == RENDERER_ANSI) {
+    size_t size = strlen(text);
 
-  attron(COLOR_PAIR(COLOR_CYAN));
-  for (i = 0; i < battery_count; i++) {
-    mvprintw(bar_y(-1), bar_x(i, 0), "%2d", i + 1);
+    screen_move(y, x);
+    put_ansi(text, (length >= 0 && (size_t) length < size) ? length : size);
+  } else {
+    mvaddnstr(y, x, text, length);
   }
-  attroff(COLOR_PAIR(COLOR_CYAN));
 }
 
-void print_battery_bars(unsigned int battery_size, int batteries[]) {
-  int i, j, k;
-
-  for (i = 0; i < battery_size; i++) {
-    if (batteries[i] < VOLTS_MIN) {
-      batteries[i] = VOLTS_MIN;
-    }
-    if (batteries[i] > VOLTS_MAX) {
-      batteries[i] = VOLTS_MAX;
-    }
+void screen_char(int c) {
+  if (RENDERER == RENDERER_ANSI) {
+    char text = c;
+    put_ansi(&text, 1);
+  } else {
+    addch(c);
+  }
+}
 
-    int current = 1 + round_to_int((batteries[i] - VOLTS_MIN) / VOLTS_STEP);
+void screen_char_at(int y, int x, int c) {
+  screen_move(y, x);
+  screen_char(c);
+}
 
-    attron(A_REVERSE);
-    attron(COLOR_PAIR(COLOR_WHITE));
-    for (j = 0; j < current; j++) {
-      for (k = 0; k < BAR_WIDTH; k++) {
-        mvaddch(bar_y(j), bar_x(i, k), ' ');
-      }
-    }
-    attroff(COLOR_PAIR(COLOR_WHITE));
-    attroff(A_REVERSE);
+// count of fill, a character with its attributes, from y, x to the right
+void screen_fill(int y, int x, chtype fill, int count) {
+  if (RENDERER == RENDERER_ANSI) {
+    unsigned char style = ansi.style;
+    int i;
 
-    for (j = current; j <= OFFSET_TOP - OFFSET_BOTTOM; j++) {
-      for (k = 0; k < BAR_WIDTH; k++) {
-        mvaddch(bar_y(j), bar_x(i, k), ' ');
-      }
+    ansi.style = ansi_style(0, fill & A_ATTRIBUTES, true);
+    for (i = 0; i < count; i++) {
+      screen_char_at(y, x + i, fill & A_CHARTEXT);
     }
+    ansi.style = style;
+    ansi.x = x;
+  } else {
+    mvhline(y, x, fill, count);
   }
-
-  move_cursor_to_bottom_line();
 }
 
-//void print_status_message(char * message) {
-//  mvprintw(bar_y(-2), 1, message);
-//}
-
-int round_to_int(double x) {
-  double half;
-  if (x > 0) {
-    half = 0.5;
+void screen_attr_on(int attr) {
+  if (RENDERER == RENDERER_ANSI) {
+    ansi.style = ansi_style(ansi.style, attr, true);
   } else {
-    half = -0.5;
+    attron(attr);
   }
-
-  return (int) (x + half);
 }
 
-void print_help(char* program_name) {
-  printf("Usage: %s SOURCE [options]...\n\n", program_name);
-  printf("  --output-file=FILE           append input file lines to this file\n");
-  printf("  --screen-height=NUMBER       screen height, in lines\n");
-  printf("  --bar-width=NUMBER           voltage value bar width, in columns\n");
-  printf("  --space-between-bars=NUMBER  space between voltage value bars,\n");
-  printf("                               in columns\n");
-  printf("  --volts-min=NUMBER           min voltage value used on the screen,\n");
-  printf("                               in volts\n");
-  printf("  --volts-max=NUMBER           max voltage value used on the screen,\n");
-  printf("                               in volts\n");
-  printf("  --max-line-length=NUMBER     max length of line that is read from\n");
-  printf("                               the data file, in bytes\n");
-  printf("  --frame-interval=NUMBER      time interval between displaying next\n");
-  printf("                               frame, in milliseconds\n");
+void screen_attr_off(int attr) {
+  if (RENDERER == RENDERER_ANSI) {
+    ansi.style = ansi_style(ansi.style, attr, false);
+  } else {
+    attroff(attr);
+  }
 }
 
-void set_options(int argc, char** argv) {
-  static struct option long_options[] = {
-      { "screen-height", 1, 0, 1 },
-      { "bar-width", 1, 0, 2 },
-      { "space-between-bars", 1, 0, 3 },
-      { "volts-min", 1, 0, 4 },
-      { "volts-max", 1, 0, 5 },
-      { "max-line-length", 1, 0, 6 },
-      { "frame-interval", 1, 0, 7 },
-      { "output-file", 1, 0, 8 },
-      { "help", 0, 0, 9 },
-      { 0, 0, 0, 0 }
-  };
+// clears from the cursor to the end of the line
+void screen_clear_line() {
+  if (RENDERER == RENDERER_ANSI) {
+    int x;
 
-  bool failure = false;
+    if (ansi.y < 0 || ansi.y >= ansi.lines) {
+      return;
+    }
+    ansi.changed = true;
+    ansi.lines_changed[ansi.y] = true;
+    for (x = (ansi.x > 0) ? ansi.x : 0; x < ansi.columns; x++) {
+      ansi.cells[ansi.y * ansi.columns + x] = (struct ansi_cell) { ' ', 0 };
+    }
+  } else {
+    clrtoeol();
+  }
+}
 
-  for (;;) {
-    int option_index = 0;
+void screen_clear() {
+  if (RENDERER == RENDERER_ANSI) {
+    int i;
 
-    int c = getopt_long_only(argc, argv, "", long_options, &option_index);
-    if (c == -1) {
-      break;
+    for (i = 0; i < ansi.lines * ansi.columns; i++) {
+      ansi.cells[i] = (struct ansi_cell) { ' ', 0 };
     }
+    memset(ansi.lines_changed, true, ansi.lines * sizeof(bool));
+    ansi.cleared = true;
+    ansi.changed = true;
+  } else {
+    clear();
+  }
+}
 
-    switch (c) {
-    case 1:
-      SCREEN_HEIGHT = atoi(optarg);
-      break;
+// draws the whole screen again on the next refresh, over what wrote on it
+void screen_redraw() {
+  if (RENDERER == RENDERER_ANSI) {
+    memset(ansi.lines_changed, true, ansi.lines * sizeof(bool));
+    ansi.cleared = true;
+    ansi.changed = true;
+  } else {
+    clearok(curscr, true);
+  }
+}
 
-    case 2:
-      BAR_WIDTH = atoi(optarg);
-      break;
+void screen_refresh() {
+  if (RENDERER == RENDERER_ANSI) {
+    refresh_ansi();
+  } else {
+    refresh();
+  }
+}
 
-    case 3:
-      SPACE_BETWEEN_BARS = atoi(optarg);
-      break;
+int screen_lines() {
+  return (RENDERER == RENDERER_ANSI) ? ansi.lines : LINES;
+}
 
-    case 4:
-      VOLTS_MIN = 10 * atoi(optarg);
-      break;
+int screen_columns() {
+  return (RENDERER == RENDERER_ANSI) ? ansi.columns : COLS;
+}
 
-    case 5:
-      VOLTS_MAX = 10 * atoi(optarg);
-      break;
+/*
+ * Returns the next key, or ERR if there is none and wait is false or if a
+ * signal came while waiting.
+ */
+int screen_key(bool wait) {
+  int key;
 
-    case 6:
-      MAX_LINE_LENGTH = atoi(optarg);
-      break;
+  if (RENDERER == RENDERER_ANSI) {
+    return read_ansi_key(wait);
+  }
+  if (wait) {
+    return getch();
+  }
+  nodelay(stdscr, true);
+  noecho();
+  key = getch();
+  echo();
+  nodelay(stdscr, false);
+  return key;
+}
 
-    case 7:
-      FRAME_INTERVAL = 1000 * atoi(optarg);
-      break;
+// puts the key back, for the next screen_key()
+void screen_unread_key(int key) {
+  if (RENDERER == RENDERER_ANSI) {
+    ansi.unread_key = key;
+  } else {
+    ungetch(key);
+  }
+}
 
-    case 8:
-      OUTPUT_FILE = optarg;
-      break;
+/*
+ * Starts the ANSI renderer on fd: the terminal, where it takes the keys from
+ * stdin and uses the alternate screen, or a file, as big as a curses screen
+ * on a file is.
+ */
+void start_ansi(int fd, bool terminal) {
+  struct winsize size;
 
-    case 9:
-      failure = true;
-      break;
+  ansi.fd = fd;
+  ansi.unread_key = ERR;
+  ansi.key_count = 0;
+  ansi.terminal = terminal;
+  if (terminal && ioctl(fd, TIOCGWINSZ, &size) == 0 && size.ws_row > 0) {
+    size_ansi(size.ws_row, size.ws_col);
+  } else {
+    size_ansi(ANSI_LINES, ANSI_COLUMNS);
+  }
 
-    case '?':
-      failure = true;
-      break;
+  if (terminal && tcgetattr(STDIN_FILENO, &ansi.saved_termios) == 0) {
+    struct termios termios = ansi.saved_termios;
 
-    default:
-      failure = true;
-    }
+    // like curses in cbreak(), noecho() and nonl(), with the signal keys
+    termios.c_lflag &= ~(ICANON | ECHO);
+    termios.c_iflag &= ~ICRNL;
+    termios.c_cc[VMIN] = 1;
+    termios.c_cc[VTIME] = 0;
+    tcsetattr(STDIN_FILENO, TCSANOW, &termios);
+    ansi.termios_set = true;
   }
-
-  if (failure) {
-    print_help(*argv);
-    exit(EXIT_FAILURE);
+  if (terminal) {
+    write_ansi(ANSI_START, sizeof(ANSI_START) - 1);
   }
+  ansi.started = true;
+}
 
-  OFFSET_TOP = SCREEN_HEIGHT - 1;
-  VOLTS_STEP = (double) (VOLTS_MAX - VOLTS_MIN) / (OFFSET_TOP - OFFSET_BOTTOM);
+// gives the terminal back as it was, from exits and signal handlers
+void stop_ansi() {
+  if (!ansi.started) {
+    return;
+  }
+  ansi.started = false;
+  if (ansi.terminal) {
+    write_ansi(ANSI_STOP, sizeof(ANSI_STOP) - 1);
+  }
+  if (ansi.termios_set) {
+    tcsetattr(STDIN_FILENO, TCSANOW, &ansi.saved_termios);
+    ansi.termios_set = false;
+  }
 }
 
-FILE* open_file(char* fileName, char* mode) {
-  FILE* file = fopen(fileName, mode);
-  if (file == NULL) {
+/*
+ * Allocates the screens and the output buffer for the size. The output
+ * buffer holds a frame that changes every cell, so that refresh_ansi()
+ * never has to grow it. The next frame clears the terminal.
+ */
+void size_ansi(int lines, int columns) {
+  size_t count = (size_t) lines * columns;
+
+  free(ansi.cells);
+  free(ansi.shown);
+  free(ansi.out);
+  free(ansi.lines_changed);
+  ansi.lines = lines;
+  ansi.columns = columns;
+  ansi.cells = malloc(count * sizeof(struct ansi_cell));
+  ansi.shown = malloc(count * sizeof(struct ansi_cell));
+  ansi.out_capacity = count * ANSI_CELL_BYTES + ANSI_FRAME_BYTES;
+  ansi.out = malloc(ansi.out_capacity);
+  ansi.lines_changed = malloc(lines * sizeof(bool));
+  if (ansi.cells == NULL || ansi.shown == NULL || ansi.out == NULL
+      || ansi.lines_changed == NULL) {
     finish_screen(0);
-    perror("Failed to open file");
+    perror("Failed to allocate screen");
     exit(EXIT_FAILURE);
   }
-
-  return file;
+  ansi.y = 0;
+  ansi.x = 0;
+  ansi.style = 0;
+  screen_clear();
 }
 
-void close_file(FILE* file) {
-  fclose(file);
+// puts the text at the cursor in the current style, cut at the right edge
+void put_ansi(const char* text, size_t length) {
+  size_t i;
+
+  if (ansi.y < 0 || ansi.y >= ansi.lines) {
+    return;
+  }
+  ansi.changed = true;
+  ansi.lines_changed[ansi.y] = true;
+  for (i = 0; i < length && ansi.x < ansi.columns; i++, ansi.x++) {
+    if (ansi.x >= 0) {
+      ansi.cells[ansi.y * ansi.columns + ansi.x] = (struct ansi_cell) {
+          text[i], ansi.style };
+    }
+  }
 }
 
-void read_voltages(char* line, int* voltages) {
-  int* voltages_offset = voltages;
+/*
+ * The style with the curses attributes turned on or off: A_BOLD, A_REVERSE
+ * and a colour pair, which sets or clears the colour.
+ */
+unsigned char ansi_style(unsigned char style, int attr, bool on) {
+  unsigned char bits = ((attr & A_BOLD) ? ANSI_BOLD : 0)
+      | ((attr & A_REVERSE) ? ANSI_REVERSE : 0);
 
-  bool battery_data_zone = false;
-  char* token = strtok(line, ",");
+  if (!on) {
+    return style & ~bits & ~((attr & A_COLOR) ? ANSI_COLOUR : 0);
+  }
+  if (attr & A_COLOR) {
+    style = (style & ~ANSI_COLOUR) | (PAIR_NUMBER(attr) & ANSI_COLOUR);
+  }
+  return style | bits;
+}
 
-  do {
-    if (*token == 'H') {
-      battery_data_zone = false;
-    }
+/*
+ * Writes the cells that changed since the last frame with one write(), as
+ * cursor moves, style changes and text.
+ */
+void refresh_ansi() {
+  char* out = ansi.out;
+  unsigned char style = 0;
+  int cursor = -1; // where the terminal's cursor is, -1 if not known
+  int i, y;
 
-    if (battery_data_zone) {
-      int x = atoi(token);
-      *voltages_offset++ = x;
+  out += sprintf(out, "\x1b[0m");
+  if (ansi.cleared) {
+    out += sprintf(out, "\x1b[H\x1b[2J");
+    for (i = 0; i < ansi.lines * ansi.columns; i++) {
+      ansi.shown[i] = (struct ansi_cell) { ' ', 0 };
     }
+    ansi.cleared = false;
+  }
 
-    if (*token == 'B') {
-      battery_data_zone = true;
+  for (y = 0; y < ansi.lines; y++) {
+    if (!ansi.lines_changed[y]) {
+      continue;
     }
-  } while (NULL != (token = strtok(NULL, ",")));
+    ansi.lines_changed[y] = false;
 
-  *voltages_offset++ = -1;
-}
+    for (i = y * ansi.columns; i < (y + 1) * ansi.columns; i++) {
+      struct ansi_cell cell = ansi.cells[i];
 
-void append_data_line(FILE* file, char* line) {
-  if (EOF == fputs(line, file) || EOF == fputc('\n', file)) {
-    finish_screen(0);
-    perror("Failed to write to file");
-    exit(EXIT_FAILURE);
+      if (cell.text == ansi.shown[i].text
+          && cell.style == ansi.shown[i].style) {
+        continue;
+      }
+      if (cursor != i) {
+        out += sprintf(out, "\x1b[%d;%dH", y + 1, i % ansi.columns + 1);
+      }
+      if (cell.style != style) {
+        out += put_ansi_style(out, cell.style);
+        style = cell.style;
+      }
+      *out++ = cell.text;
+      ansi.shown[i] = cell;
+      // the terminal waits at the last column instead of moving on
+      cursor = ((i + 1) % ansi.columns != 0) ? i + 1 : -1;
+    }
+  }
+
+  if (style != 0) {
+    out += sprintf(out, "\x1b[0m");
+  }
+  if (ansi.y >= 0 && ansi.y < ansi.lines) {
+    out += sprintf(out, "\x1b[%d;%dH", ansi.y + 1,
+        (ansi.x < ansi.columns ? ansi.x : ansi.columns - 1) + 1);
   }
+  write_ansi(ansi.out, out - ansi.out);
+  ansi.changed = false;
 }
 
-bool is_valid_line(char* line) {
-  bool valid_line = true;
+// writes the SGR sequence of the style, returns its length
+size_t put_ansi_style(char* out, unsigned char style) {
+  char* start = out;
+  int colour = style & ANSI_COLOUR;
 
-  char* tmp = malloc(strlen(line) + 1);
+  out += sprintf(out, "\x1b[0");
+  if (style & ANSI_BOLD) {
+    out += sprintf(out, ";1");
+  }
+  if (style & ANSI_REVERSE) {
+    out += sprintf(out, ";7");
+  }
+  // pair 0 is the terminal's colours, the others are on black as in curses
+  if (colour != 0) {
+    out += sprintf(out, ";%d;40", 30 + colour);
+  }
+  *out++ = 'm';
+  return out - start;
+}
+
+// one write(), unless the terminal takes less than the whole frame
+void write_ansi(const char* data, size_t size) {
+  while (size > 0) {
+    ssize_t n = write(ansi.fd, data, size);
+    if (n == -1 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return;
+    }
+    data += n;
+    size -= n;
+  }
+}
+
+/*
+ * Reads a key from stdin, with the escape sequences of the keys the screen
+ * uses made into their curses codes. Returns ERR when there is no key and
+ * wait is false, or when a signal comes while waiting. What was drawn since
+ * the last frame is shown first, as getch() does.
+ */
+int read_ansi_key(bool wait) {
+  int key;
+
+  if (ansi.changed) {
+    refresh_ansi();
+  }
+  if (ansi.unread_key != ERR) {
+    key = ansi.unread_key;
+    ansi.unread_key = ERR;
+    return key;
+  }
+  if (ansi.key_count == 0) {
+    struct pollfd input = { .fd = STDIN_FILENO, .events = POLLIN };
+
+    if (poll(&input, 1, wait ? -1 : 0) <= 0) {
+      return ERR;
+    }
+    ssize_t n = read(STDIN_FILENO, ansi.keys, sizeof(ansi.keys));
+    if (n <= 0) {
+      return ERR;
+    }
+    ansi.key_count = n;
+  }
+
+  unsigned int length = 1;
+  key = ansi.keys[0];
+  if (key == 0x1B && ansi.key_count >= 3
+      && (ansi.keys[1] == '[' || ansi.keys[1] == 'O')) {
+    unsigned char final = ansi.keys[2];
+    length = 3;
+    // ESC [ 5 ~ and the like
+    if (final >= '0' && final <= '9' && ansi.key_count >= 4
+        && ansi.keys[3] == '~') {
+      length = 4;
+    }
+    key = (final == 'A') ? KEY_UP : (final == 'B') ? KEY_DOWN
+        : (final == 'C') ? KEY_RIGHT : (final == 'D') ? KEY_LEFT
+        : (final == 'H' || (length == 4 && (final == '1' || final == '7')))
+        ? KEY_HOME
+        : (final == 'F' || (length == 4 && (final == '4' || final == '8')))
+        ? KEY_END : (final == 'Z') ? KEY_BTAB
+        : (length == 4 && final == '5') ? KEY_PPAGE
+        : (length == 4 && final == '6') ? KEY_NPAGE : 0x1B;
+    if (key == 0x1B) {
+      length = 1;
+    }
+  }
+  ansi.key_count -= length;
+  memmove(ansi.keys, ansi.keys + length, ansi.key_count);
+  return key;
+}
+
+// -1 for the cell numbers wraps around to the first row of bar_rows
+int bar_y(unsigned int positions_up_from_bottom) {
+  return bar_rows[positions_up_from_bottom + 1];
+}
+
+int bar_x(unsigned int bar_position, unsigned int bar_width) {
+  return bar_columns[bar_position - first_bar] + bar_width;
+}
+
+// the last line, under the cell numbers and the cell stats
+int bottom_line_y() {
+  return SCREEN_HEIGHT - 1;
+}
+
+void move_cursor_to_bottom_line() {
+  screen_move(bottom_line_y(), 0);
+}
+
+void print_left_panel() {
+  screen_attr_on(COLOR_PAIR(COLOR_CYAN));
+  screen_attr_on(A_BOLD);
+  screen_print_at(0, OFFSET_LEFT - 6, "Volts:");
+  screen_attr_off(A_BOLD);
+
+  int i;
+  for (i = 0; i <= OFFSET_TOP - OFFSET_BOTTOM; i += 2) {
+    screen_print_at(bar_y(i), OFFSET_LEFT - 6, "%5.2f", (VOLTS_MIN + i * VOLTS_STEP)
+        / 10.0);
+  }
+
+  screen_attr_on(A_BOLD);
+  screen_print_at(bar_y(-1), 1, "Battery:");
+  screen_attr_off(A_BOLD);
+  for (i = 0; i < CELL_STAT_COUNT; i++) {
+    if (SHOWN_CELL_STATS & (1 << i)) {
+      screen_print_at(cell_stat_y(i), 1, "%8s", CELL_STAT_LABELS[i]);
+    }
+  }
+  screen_attr_off(COLOR_PAIR(COLOR_CYAN));
+
+  move_cursor_to_bottom_line();
+}
+
+/*
+ * Numbers the bars on the screen. Compressed bars get a number every few
+ * bars, so that the numbers do not run into each other, and scrolled bars
+ * get arrows on the side that has more bars.
+ */
+void print_bottom_panel(int battery_count) {
+  unsigned int pitch = drawn_bar_space + drawn_bar_width;
+  unsigned int label = (battery_count >= 100) ? 4 : (battery_count >= 10) ? 3
+      : 2;
+  unsigned int step = 1;
+  unsigned int i;
+
+  if (pitch > 0 && pitch < label) {
+    step = (label + pitch - 1) / pitch;
+  }
+
+  screen_attr_on(COLOR_PAIR(COLOR_CYAN));
+  for (i = first_bar; i < first_bar + shown_bar_count; i++) {
+    if (i % step == 0) {
+      screen_print_at(bar_y(-1), bar_x(i, 0), "%2d", i + 1);
+    }
+  }
+  if (shown_bar_count < (unsigned int) battery_count) {
+    screen_char_at(bar_y(-1), OFFSET_LEFT - 1, first_bar > 0 ? '<' : ' ');
+    if (first_bar + shown_bar_count < (unsigned int) battery_count) {
+      screen_char_at(bar_y(-1), screen_columns() - 1, '>');
+    }
+  }
+  screen_attr_off(COLOR_PAIR(COLOR_CYAN));
+}
+
+/*
+ * Draws the bars of the frame. Only the rows between the height that is on
+ * the screen and the new height are drawn.
+ */
+void print_battery_bars(const struct frame* frame) {
+  const struct section* cells = &frame->sections[SECTION_B];
+  unsigned int i;
+
+  if (cells->count != drawn_bar_count) {
+    set_drawn_bar_count(cells->count);
+  }
+
+  for (i = 0; i < cells->count; i++) {
+    int volts = cells->values[i];
+    if (volts < (int) VOLTS_MIN) {
+      volts = VOLTS_MIN;
+    }
+    if (volts > (int) VOLTS_MAX) {
+      volts = VOLTS_MAX;
+    }
+
+    unsigned int current = BAR_LEVELS[volts - VOLTS_MIN].height;
+    unsigned char colour = ALARM_COLOURS[frame->alarms[i]];
+    drawn_volts[i] = volts;
+
+    if (colour != drawn_colours[i]) {
+      print_bar_rows(i, 0, current, bar_fill(colour));
+      drawn_colours[i] = colour;
+    } else if (current > drawn_heights[i]) {
+      print_bar_rows(i, drawn_heights[i], current, bar_fill(colour));
+    }
+    if (current < drawn_heights[i]) {
+      print_bar_rows(i, current, drawn_heights[i], ' ');
+    }
+    drawn_heights[i] = current;
+  }
+
+  move_cursor_to_bottom_line();
+}
+
+// draws rows [from, to) of the bar with fill, if the bar is on the screen
+void print_bar_rows(unsigned int bar, unsigned int from, unsigned int to,
+    chtype fill) {
+  unsigned int j;
+
+  if (!bar_shown(bar)) {
+    return;
+  }
+  for (j = from; j < to; j++) {
+    screen_fill(bar_y(j), bar_x(bar, 0), fill, drawn_bar_width);
+  }
+}
+
+bool bar_shown(unsigned int bar) {
+  return bar >= first_bar && bar < first_bar + shown_bar_count;
+}
+
+chtype bar_fill(unsigned char colour) {
+  return ' ' | A_REVERSE | COLOR_PAIR(colour);
+}
+
+/*
+ * Changes the number of bars on the screen. Bars that are gone are blanked,
+ * new bars start empty, and the bar numbers are printed again.
+ */
+void set_drawn_bar_count(unsigned int bar_count) {
+  unsigned int i;
+
+  for (i = bar_count; i < drawn_bar_count; i++) {
+    print_bar_rows(i, 0, drawn_heights[i], ' ');
+  }
+
+  if (bar_count > drawn_bar_capacity) {
+    unsigned int* heights = realloc(drawn_heights,
+        bar_count * sizeof(unsigned int));
+    if (heights != NULL) {
+      drawn_heights = heights;
+      drawn_colours = realloc(drawn_colours, bar_count);
+      drawn_volts = realloc(drawn_volts, bar_count * sizeof(int));
+    }
+    if (heights == NULL || drawn_colours == NULL || drawn_volts == NULL) {
+      finish_screen(0);
+      perror("Failed to allocate bars");
+      exit(EXIT_FAILURE);
+    }
+    drawn_bar_capacity = bar_count;
+  }
+
+  for (i = drawn_bar_count; i < bar_count; i++) {
+    drawn_heights[i] = 0;
+    drawn_colours[i] = COLOR_WHITE;
+    drawn_volts[i] = VOLTS_MIN;
+  }
+  drawn_bar_count = bar_count;
+
+  if (set_bar_geometry(bar_count)) {
+    print_all_bars();
+  } else {
+    screen_move(bar_y(-1), bar_x(first_bar, 0));
+    screen_clear_line();
+    print_bottom_panel(bar_count);
+  }
+}
+
+/*
+ * Fits bar_count bars on the terminal width. Bars that do not fit are first
+ * moved closer and narrowed, down to one column each, and when even that is
+ * too wide they keep their width and scroll sideways with the arrow keys.
+ * Returns true if the bars on the screen moved.
+ */
+bool set_bar_geometry(unsigned int bar_count) {
+  // room for the last number and '>'
+  int columns = screen_columns() - OFFSET_LEFT - 3;
+  unsigned int width = BAR_WIDTH;
+  unsigned int space = SPACE_BETWEEN_BARS;
+  unsigned int pitch;
+  unsigned int i;
+
+  if (columns < 1) {
+    columns = 1;
+  }
+  pitch = (bar_count > 0) ? columns / bar_count : columns;
+  if (pitch > 0 && pitch < width + space) {
+    space = (space > 0 && pitch >= 2) ? 1 : 0;
+    if (width > pitch - space) {
+      width = pitch - space;
+    }
+  }
+
+  bool moved = (width != drawn_bar_width || space != drawn_bar_space);
+  drawn_bar_width = width;
+  drawn_bar_space = space;
+
+  shown_bar_count = (width + space > 0) ? columns / (width + space) : bar_count;
+  if (shown_bar_count >= bar_count) {
+    shown_bar_count = bar_count;
+  }
+  if (first_bar + shown_bar_count > bar_count) {
+    moved = true;
+    first_bar = bar_count - shown_bar_count;
+  }
+
+  // and one past the last one, where the cursor goes with no bars
+  int* columns_of_bars = realloc(bar_columns, (shown_bar_count + 1)
+      * sizeof(int));
+  if (columns_of_bars == NULL) {
+    finish_screen(0);
+    perror("Failed to allocate bars");
+    exit(EXIT_FAILURE);
+  }
+  bar_columns = columns_of_bars;
+  for (i = 0; i <= shown_bar_count; i++) {
+    bar_columns[i] = 1 + OFFSET_LEFT + (space + width) * i;
+  }
+
+  return moved;
+}
+
+// draws all bars on the screen again, from the voltages they show
+void print_all_bars() {
+  unsigned int i;
+  int y;
+
+  for (y = bar_y(OFFSET_TOP - OFFSET_BOTTOM); y < bottom_line_y() - 1; y++) {
+    screen_move(y, OFFSET_LEFT - 1);
+    screen_clear_line();
+  }
+  print_bottom_panel(drawn_bar_count);
+
+  for (i = 0; i < drawn_bar_count; i++) {
+    drawn_heights[i] = BAR_LEVELS[drawn_volts[i] - VOLTS_MIN].height;
+    print_bar_rows(i, 0, drawn_heights[i], bar_fill(drawn_colours[i]));
+  }
+  if (SHOWN_CELL_STATS != 0 && sources != NULL
+      && shown_source != SOURCE_SUMMARY) {
+    print_cell_stats(&sources[shown_source]);
+  }
+  move_cursor_to_bottom_line();
+}
+
+// row of a cell stat, under the cell numbers in the order of enum cell_stat
+int cell_stat_y(enum cell_stat stat) {
+  int y = bar_y(-1);
+  unsigned int i;
+
+  for (i = 0; i <= stat; i++) {
+    y += (SHOWN_CELL_STATS >> i) & 1;
+  }
+  return y;
+}
+
+/*
+ * Prints the shown cell stats of the source under its bars, in volts. Like
+ * the cell numbers, only every so many bars have theirs when the bars are
+ * too close for the text.
+ */
+void print_cell_stats(const struct source* source) {
+  unsigned int pitch = drawn_bar_space + drawn_bar_width;
+  unsigned int step = 1;
+  unsigned int i, bar;
+
+  if (pitch > 0 && pitch < CELL_STAT_WIDTH + 1) {
+    step = (CELL_STAT_WIDTH + pitch) / pitch;
+  }
+
+  for (i = 0; i < CELL_STAT_COUNT; i++) {
+    const float* values = source->cell_stats + i * source->cell_capacity;
+    int y = cell_stat_y(i);
+
+    if (!(SHOWN_CELL_STATS & (1 << i))) {
+      continue;
+    }
+    screen_move(y, OFFSET_LEFT - 1);
+    screen_clear_line();
+    for (bar = first_bar; bar < first_bar + shown_bar_count
+        && bar < source->cell_count; bar++) {
+      char text[16];
+
+      if (bar % step != 0) {
+        continue;
+      }
+      // rounded first, so that nothing shows as -0.00
+      float scale = (i == CELL_DEVIATION) ? 10 : 100;
+      float volts = roundf(values[bar] / 10 * scale) / scale + 0.0f;
+      snprintf(text, sizeof(text), i == CELL_AVERAGE ? "%.2f" : i == CELL_RATE
+          ? "%+.2f" : "%+.1f", volts);
+      screen_text_at(y, bar_x(bar, 0), text, CELL_STAT_WIDTH);
+    }
+  }
+}
+
+/*
+ * Shows or hides the cell stats with 'c', which takes the rows of the bars
+ * or gives them back.
+ */
+bool switch_cell_stats(int key) {
+  if (key != 'c') {
+    return false;
+  }
+
+  SHOWN_CELL_STATS = (SHOWN_CELL_STATS != 0) ? 0 : CELL_STATS;
+  set_screen_layout();
+  show_source(shown_source);
+  return true;
+}
+
+// scrolls the bars for the arrow keys, returns false for other keys
+bool scroll_bars(int key) {
+  if (shown_bar_count >= drawn_bar_count) {
+    return false;
+  }
+
+  if (key == KEY_LEFT && first_bar > 0) {
+    first_bar--;
+  } else if (key == KEY_RIGHT && first_bar + shown_bar_count < drawn_bar_count) {
+    first_bar++;
+  } else {
+    return key == KEY_LEFT || key == KEY_RIGHT;
+  }
+
+  print_all_bars();
+  return true;
+}
+
+// handles the keys of the screen, returns false for keys it has no use for
+bool handle_key(int key) {
+  if (key == 's') {
+    SHOW_STATUS = !SHOW_STATUS;
+    if (!SHOW_STATUS) {
+      print_status_message("");
+    }
+    return true;
+  }
+  return switch_source(key) || switch_history(key) || request_jump(key)
+      || switch_cell_stats(key) || (SHOWN_HISTORY < 0 && scroll_bars(key));
+}
+
+/*
+ * Asks the reader of the shown source to jump to the first or the last
+ * frame with Home and End, or a part of the file back or on with Page Up
+ * and Page Down. Returns false for other keys.
+ */
+bool request_jump(int key) {
+  enum jump jump = (key == KEY_HOME) ? JUMP_FIRST : (key == KEY_END)
+      ? JUMP_LAST : (key == KEY_PPAGE) ? JUMP_BACK : (key == KEY_NPAGE)
+      ? JUMP_FORWARD : JUMP_NONE;
+
+  if (jump == JUMP_NONE) {
+    return false;
+  }
+  if (shown_source != SOURCE_SUMMARY) {
+    atomic_store_explicit(&sources[shown_source].ingest.jump, jump,
+        memory_order_relaxed);
+  }
+  return true;
+}
+
+/*
+ * Switches between the summary and the sources with Tab and Shift-Tab, or
+ * with 0 for the summary and 1 to 9 for the first sources. Returns false for
+ * other keys, and for every key with one source.
+ */
+bool switch_source(int key) {
+  int tabs = source_count + 1; // the summary is tab 0
+  int tab = shown_source + 1;
+
+  if (source_count < 2) {
+    return false;
+  }
+
+  if (key == '\t') {
+    tab = (tab + 1) % tabs;
+  } else if (key == KEY_BTAB) {
+    tab = (tab + tabs - 1) % tabs;
+  } else if (key >= '0' && key <= '9' && key - '0' < tabs) {
+    tab = key - '0';
+  } else {
+    return false;
+  }
+
+  show_source(tab - 1);
+  return true;
+}
+
+/*
+ * Draws the screen for a source, or for the summary, from what the sources
+ * last showed. Frames keep coming to every source while another is shown.
+ * The bars of a source give way to its history while that is on.
+ */
+void show_source(int index) {
+  shown_source = index;
+  screen_clear();
+  first_bar = 0;
+  drawn_bar_count = 0;
+
+  if (index == SOURCE_SUMMARY) {
+    print_summary();
+  } else if (SHOWN_HISTORY >= 0) {
+    print_history(&sources[index]);
+  } else {
+    struct source* source = &sources[index];
+    unsigned int i;
+
+    print_left_panel();
+    set_drawn_bar_count(source->cell_count);
+    for (i = 0; i < source->cell_count; i++) {
+      int volts = source->volts[i];
+      drawn_volts[i] = volts < (int) VOLTS_MIN ? (int) VOLTS_MIN
+          : volts > (int) VOLTS_MAX ? (int) VOLTS_MAX : volts;
+      drawn_colours[i] = ALARM_COLOURS[source->levels[i]];
+    }
+    print_all_bars();
+  }
+
+  print_tabs();
+  update_status_line(true);
+}
+
+/*
+ * Names the tabs on the top line, right of the scale, with the shown one
+ * reversed and each source in the colour of its worst cell.
+ */
+void print_tabs() {
+  int x = OFFSET_LEFT + 1;
+  unsigned int i;
+
+  if (source_count < 2) {
+    return;
+  }
+
+  screen_move(0, x);
+  screen_clear_line();
+  screen_attr_on(COLOR_PAIR(COLOR_CYAN));
+  if (shown_source == SOURCE_SUMMARY) {
+    screen_attr_on(A_REVERSE);
+  }
+  screen_text_at(0, x, " 0 All ", -1);
+  screen_attr_off(A_REVERSE);
+  screen_attr_off(COLOR_PAIR(COLOR_CYAN));
+  x += 8;
+
+  for (i = 0; i < source_count && x < screen_columns(); i++) {
+    const char* name = strrchr(sources[i].name, '/');
+    char tab[24];
+    int length;
+
+    name = (name != NULL && name[1] != '\0') ? name + 1 : sources[i].name;
+    length = snprintf(tab, sizeof(tab), " %u %.12s ", i + 1, name);
+
+    screen_attr_on(COLOR_PAIR(ALARM_COLOURS[sources[i].level]));
+    if ((int) i == shown_source) {
+      screen_attr_on(A_REVERSE);
+    }
+    screen_text_at(0, x, tab, screen_columns() - x);
+    screen_attr_off(A_REVERSE);
+    screen_attr_off(COLOR_PAIR(ALARM_COLOURS[sources[i].level]));
+    x += length + 1;
+  }
+  move_cursor_to_bottom_line();
+}
+
+// prints a line for each source, and one for all of them together
+void print_summary() {
+  struct source all = { .name = "All", .level = ALARM_NORMAL };
+  int all_low = INT_MAX, all_high = INT_MIN;
+  int y = 2;
+  unsigned int i;
+
+  screen_attr_on(COLOR_PAIR(COLOR_CYAN));
+  screen_attr_on(A_BOLD);
+  screen_print_at(y++, 1, "%-22s %5s %5s %6s %6s %9s  %-13s %6s", "Source", "Packs",
+      "Cells", "Min V", "Max V", "Frames", "Alarm", "Age s");
+  screen_attr_off(A_BOLD);
+  screen_attr_off(COLOR_PAIR(COLOR_CYAN));
+
+  for (i = 0; i < source_count && y < bottom_line_y(); i++) {
+    const struct source* source = &sources[i];
+    int low = INT_MAX, high = INT_MIN;
+    unsigned int j;
+
+    for (j = 0; j < source->cell_count; j++) {
+      low = source->volts[j] < low ? source->volts[j] : low;
+      high = source->volts[j] > high ? source->volts[j] : high;
+    }
+    all_low = low < all_low ? low : all_low;
+    all_high = high > all_high ? high : all_high;
+    all.pack_count += source->pack_count;
+    all.cell_count += source->cell_count;
+    all.frames += source->frames;
+    if (alarm_severity(source->level) > alarm_severity(all.level)) {
+      all.level = source->level;
+    }
+    print_summary_line(y++, source, low, high);
+  }
+
+  screen_attr_on(A_BOLD);
+  print_summary_line(y, &all, all_low, all_high);
+  screen_attr_off(A_BOLD);
+  move_cursor_to_bottom_line();
+}
+
+void print_summary_line(int y, const struct source* source, int low,
+    int high) {
+  screen_print_at(y, 1, "%-22.22s %5u %5u", source->name, source->pack_count,
+      source->cell_count);
+  if (low <= high) {
+    screen_print(" %4d.%d %4d.%d", low / 10, low % 10, high / 10, high % 10);
+  } else {
+    screen_print(" %6s %6s", "-", "-");
+  }
+  screen_print(" %9lu  ", source->frames);
+
+  screen_attr_on(COLOR_PAIR(ALARM_COLOURS[source->level]));
+  screen_print("%-13s", ALARM_NAMES[source->level]);
+  screen_attr_off(COLOR_PAIR(ALARM_COLOURS[source->level]));
+  if (source->updated_ms > 0) {
+    screen_print(" %6.1f", (monotonic_ms() - source->updated_ms) / 1000.0);
+  }
+  screen_clear_line();
+}
+
+// steps the history through its spans and back to the bars with 'h'
+bool switch_history(int key) {
+  if (key != 'h') {
+    return false;
+  }
+
+  SHOWN_HISTORY = (SHOWN_HISTORY + 1 < HISTORY_LEVELS) ? SHOWN_HISTORY + 1
+      : -1;
+  if (shown_source != SOURCE_SUMMARY) {
+    show_source(shown_source);
+  }
+  return true;
+}
+
+/*
+ * Draws a line for every cell of the source with the lowest voltage in each
+ * bucket of the shown span, the newest on the right, then the min, max and
+ * mean of those buckets. A bucket takes the colour of the worse alarm of its
+ * lowest and highest voltage.
+ */
+void print_history(struct source* source) {
+  struct history* history = &source->ingest.history;
+  unsigned int level = SHOWN_HISTORY;
+  // the cell number, and the min, max and mean
+  int width = screen_columns() - 29;
+  int y = 1;
+  char title[48];
+  unsigned int i;
+
+  if (width > HISTORY_BUCKETS) {
+    width = HISTORY_BUCKETS;
+  } else if (width < 0) {
+    width = 0;
+  }
+  snprintf(title, sizeof(title), "Lowest by %s, newest on the right",
+      HISTORY_NAMES[level]);
+
+  screen_attr_on(COLOR_PAIR(COLOR_CYAN));
+  screen_attr_on(A_BOLD);
+  screen_print_at(y++, 1, "%4s  %-*.*s %6s %6s %6s", "Cell", width, width, title,
+      "Min V", "Max V", "Mean V");
+  screen_attr_off(A_BOLD);
+  screen_attr_off(COLOR_PAIR(COLOR_CYAN));
+
+  if (atomic_load_explicit(&source->ingest.frames->ready,
+      memory_order_acquire)) {
+    pthread_mutex_lock(&history->lock);
+    const struct history_bucket* buckets = history->buckets
+        + level * HISTORY_BUCKETS * history->capacity;
+    unsigned int oldest = (history->newest[level] + HISTORY_BUCKETS + 1
+        - width) % HISTORY_BUCKETS;
+
+    for (i = 0; i < source->cell_count && i < history->capacity
+        && y < bottom_line_y(); i++) {
+      print_history_line(y++, buckets, width, i, history->capacity, oldest);
+    }
+    pthread_mutex_unlock(&history->lock);
+  }
+
+  for (; y < bottom_line_y(); y++) {
+    screen_move(y, 0);
+    screen_clear_line();
+  }
+  move_cursor_to_bottom_line();
+}
+
+void print_history_line(int y, const struct history_bucket* buckets,
+    unsigned int width, unsigned int cell, unsigned int capacity,
+    unsigned int oldest) {
+  unsigned int steps = sizeof(HISTORY_RAMP) - 2;
+  int low = INT_MAX, high = INT_MIN;
+  int64_t sum = 0;
+  uint64_t count = 0;
+  unsigned int i;
+
+  screen_print_at(y, 1, "%4u  ", cell + 1);
+  for (i = 0; i < width; i++) {
+    const struct history_bucket* bucket = &buckets[((oldest + i)
+        % HISTORY_BUCKETS) * capacity + cell];
+
+    if (bucket->count == 0) {
+      screen_char(' ');
+      continue;
+    }
+
+    enum alarm_level level = alarm_level(bucket->min, ALARM_NORMAL);
+    enum alarm_level high_level = alarm_level(bucket->max, ALARM_NORMAL);
+    if (alarm_severity(high_level) > alarm_severity(level)) {
+      level = high_level;
+    }
+    int volts = bucket->min < (int) VOLTS_MIN ? (int) VOLTS_MIN
+        : bucket->min > (int) VOLTS_MAX ? (int) VOLTS_MAX : bucket->min;
+
+    screen_attr_on(COLOR_PAIR(ALARM_COLOURS[level]));
+    screen_char(HISTORY_RAMP[(volts - VOLTS_MIN) * steps
+        / (VOLTS_MAX - VOLTS_MIN)]);
+    screen_attr_off(COLOR_PAIR(ALARM_COLOURS[level]));
+
+    low = bucket->min < low ? bucket->min : low;
+    high = bucket->max > high ? bucket->max : high;
+    sum += bucket->sum;
+    count += bucket->count;
+  }
+
+  if (count > 0) {
+    int mean = sum / (int64_t) count;
+    screen_print(" %4d.%d %4d.%d %4d.%d", low / 10, low % 10, high / 10, high % 10,
+        mean / 10, mean % 10);
+  } else {
+    screen_print(" %6s %6s %6s", "-", "-", "-");
+  }
+  screen_clear_line();
+}
+
+// keeps the newest cells of a source, for the summary and its tab
+void remember_frame(struct source* source, const struct frame* frame) {
+  const struct section* cells = &frame->sections[SECTION_B];
+  unsigned int i;
+
+  if (cells->count > source->cell_capacity) {
+    int* volts = realloc(source->volts, cells->count * sizeof(int));
+    if (volts != NULL) {
+      source->volts = volts;
+      source->levels = realloc(source->levels, cells->count);
+      source->cell_stats = realloc(source->cell_stats, CELL_STAT_COUNT
+          * cells->count * sizeof(float));
+    }
+    if (volts == NULL || source->levels == NULL
+        || source->cell_stats == NULL) {
+      finish_screen(0);
+      perror("Failed to allocate source cells");
+      exit(EXIT_FAILURE);
+    }
+    source->cell_capacity = cells->count;
+  }
+
+  for (i = 0; i < CELL_STAT_COUNT; i++) {
+    memcpy(source->cell_stats + i * source->cell_capacity,
+        frame->cell_stats[i], cells->count * sizeof(float));
+  }
+  source->level = ALARM_NORMAL;
+  for (i = 0; i < cells->count; i++) {
+    source->volts[i] = cells->values[i];
+    source->levels[i] = frame->alarms[i];
+    if (alarm_severity(frame->alarms[i]) > alarm_severity(source->level)) {
+      source->level = frame->alarms[i];
+    }
+  }
+  source->cell_count = cells->count;
+  source->pack_count = frame->pack_count;
+  source->frames = atomic_load_explicit(&source->ingest.frames->head,
+      memory_order_relaxed) + atomic_load_explicit(
+      &source->ingest.frames->dropped, memory_order_relaxed);
+  source->updated_ms = monotonic_ms();
+}
+
+// 0 for normal cells, 1 for warnings and 2 for critical cells
+unsigned int alarm_severity(enum alarm_level level) {
+  return abs((int) level - ALARM_NORMAL);
+}
+
+bool sources_finished() {
+  unsigned int i;
+
+  for (i = 0; i < source_count; i++) {
+    if (!atomic_load_explicit(&sources[i].ingest.frames->finished,
+        memory_order_acquire)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// handles the keys that were pressed while frames were drawn
+void read_keys() {
+  int key;
+
+  while ((key = screen_key(false)) != ERR) {
+    if (!handle_key(key)) {
+      screen_unread_key(key); // left for wait_for_key() to end on
+      break;
+    }
+  }
+}
+
+// waits for a key to exit, following resizes, scrolling and signals until then
+void wait_for_key() {
+  for (;;) {
+    if (screen_resized) {
+      resize_screen();
+    }
+    if (stats_requested) {
+      dump_stats();
+    }
+    update_status_line(true);
+
+    int key = screen_key(true);
+    if (key == ERR && (screen_resized || stats_requested)) {
+      continue;
+    }
+    if (key == ERR || !handle_key(key)) {
+      return;
+    }
+  }
+}
+
+void handle_resize(int sig) {
+  screen_resized = 1;
+}
+
+void handle_stats_request(int sig) {
+  stats_requested = 1;
+}
+
+/*
+ * Lays the screen out again for the new terminal size: the scale, the bar
+ * levels, the panels and the bars. Runs once for each resize, from the
+ * render loop.
+ */
+void resize_screen() {
+  struct winsize size;
+
+  screen_resized = 0;
+  if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &size) == 0 && size.ws_row > 0) {
+    if (RENDERER == RENDERER_ANSI) {
+      size_ansi(size.ws_row, size.ws_col);
+    } else {
+      resizeterm(size.ws_row, size.ws_col);
+    }
+  }
+  if (!SCREEN_HEIGHT_SET) {
+    SCREEN_HEIGHT = screen_lines();
+    set_screen_layout();
+  }
+
+  if (source_count > 1 || SHOWN_HISTORY >= 0) {
+    show_source(shown_source);
+    return;
+  }
+
+  screen_clear();
+  print_left_panel();
+  set_bar_geometry(drawn_bar_count);
+  print_all_bars();
+}
+
+void print_status_message(char* message) {
+  screen_text_at(bottom_line_y(), 1, message, screen_columns() - 2);
+  screen_clear_line();
+  move_cursor_to_bottom_line();
+}
+
+// adds to a counter that only the calling thread writes
+void add_stat(atomic_ullong* counter, unsigned long long value) {
+  atomic_store_explicit(counter, atomic_load_explicit(counter,
+      memory_order_relaxed) + value, memory_order_relaxed);
+}
+
+void count_line(bool valid, long long start_ns) {
+  add_stat(&stats.parse_ns, monotonic_ns() - start_ns);
+  add_stat(&stats.lines_read, 1);
+  if (!valid) {
+    add_stat(&stats.lines_rejected, 1);
+  }
+}
+
+void count_parse_errors(const struct frame* frame) {
+  unsigned int i;
+
+  for (i = 0; i < PARSE_ERROR_COUNT; i++) {
+    if (frame->errors[i] != 0) {
+      add_stat(&stats.parse_errors[i], frame->errors[i]);
+    }
+  }
+}
+
+void take_stats(struct stats_snapshot* snapshot) {
+  const struct log_ring* log = sources[0].ingest.log;
+  unsigned int i;
+
+  snapshot->time_ms = monotonic_ms();
+  snapshot->lines_read = atomic_load(&stats.lines_read);
+  snapshot->lines_rejected = atomic_load(&stats.lines_rejected);
+  for (i = 0; i < PARSE_ERROR_COUNT; i++) {
+    snapshot->parse_errors[i] = atomic_load(&stats.parse_errors[i]);
+  }
+  snapshot->frames_read = atomic_load(&stats.frames_read);
+  snapshot->parse_ns = atomic_load(&stats.parse_ns);
+  snapshot->frames_drawn = atomic_load(&stats.frames_drawn);
+  snapshot->draw_ns = atomic_load(&stats.draw_ns);
+  snapshot->refresh_ns = atomic_load(&stats.refresh_ns);
+  snapshot->frames_dropped = 0;
+  for (i = 0; i < source_count; i++) {
+    snapshot->frames_dropped += atomic_load(&sources[i].ingest.frames->dropped);
+  }
+  snapshot->bytes_written = (log != NULL) ? atomic_load(&log->bytes_written)
+      : 0;
+}
+
+void print_stats(FILE* file, const struct stats_snapshot* snapshot) {
+  unsigned long long lines = snapshot->lines_read > 0 ? snapshot->lines_read
+      : 1;
+  unsigned long long frames = snapshot->frames_drawn > 0
+      ? snapshot->frames_drawn : 1;
+  unsigned int i;
+
+  fprintf(file, "Lines read:      %llu\n", snapshot->lines_read);
+  fprintf(file, "Lines rejected:  %llu\n", snapshot->lines_rejected);
+  for (i = 0; i < PARSE_ERROR_COUNT; i++) {
+    char label[32];
+
+    snprintf(label, sizeof(label), "%s:", PARSE_ERROR_NAMES[i]);
+    fprintf(file, "%-17s%llu\n", label, snapshot->parse_errors[i]);
+  }
+  fprintf(file, "Frames read:     %llu\n", snapshot->frames_read);
+  fprintf(file, "Frames drawn:    %llu\n", snapshot->frames_drawn);
+  fprintf(file, "Frames dropped:  %llu\n", snapshot->frames_dropped);
+  fprintf(file, "Bytes written:   %llu\n", snapshot->bytes_written);
+  fprintf(file, "Parse:           %llu ns/line\n", snapshot->parse_ns / lines);
+  fprintf(file, "Draw:            %llu ns/frame\n", snapshot->draw_ns / frames);
+  fprintf(file, "Refresh:         %llu ns/frame\n",
+      snapshot->refresh_ns / frames);
+}
+
+/*
+ * Shows the rates of the last STATUS_INTERVAL on the status line, if it is
+ * on. Where the time goes tells whether the input, the parser or the
+ * terminal is what holds the screen back.
+ */
+void update_status_line(bool force) {
+  static struct stats_snapshot last;
+  struct stats_snapshot now;
+  char message[160];
+
+  if (!SHOW_STATUS || (!force && monotonic_ms() - last.time_ms
+      < STATUS_INTERVAL)) {
+    return;
+  }
+  take_stats(&now);
+
+  double seconds = (now.time_ms - last.time_ms) / 1000.0;
+  unsigned long long lines = now.lines_read - last.lines_read;
+  unsigned long long frames = now.frames_drawn - last.frames_drawn;
+  if (seconds <= 0) {
+    seconds = 1;
+  }
+
+  snprintf(message, sizeof(message), "%.0f lines/s, %llu bad, %llu salvaged,"
+      " parse %llu ns, draw %.1f us, refresh %.1f us, %llu dropped,"
+      " %.1f KB/s", lines / seconds, now.lines_rejected - last.lines_rejected,
+      now.parse_errors[PARSE_SALVAGED] - last.parse_errors[PARSE_SALVAGED],
+      lines > 0 ? (now.parse_ns - last.parse_ns) / lines : 0,
+      frames > 0 ? (now.draw_ns - last.draw_ns) / frames / 1000.0 : 0,
+      frames > 0 ? (now.refresh_ns - last.refresh_ns) / frames / 1000.0 : 0,
+      now.frames_dropped - last.frames_dropped,
+      (now.bytes_written - last.bytes_written) / seconds / 1024);
+  print_status_message(message);
+  last = now;
+}
+
+// writes the counters to stderr for SIGUSR1, and draws the screen again
+void dump_stats() {
+  struct stats_snapshot snapshot;
+
+  stats_requested = 0;
+  take_stats(&snapshot);
+  print_stats(stderr, &snapshot);
+  screen_redraw();
+}
+
+int round_to_int(double x) {
+  double half;
+  if (x > 0) {
+    half = 0.5;
+  } else {
+    half = -0.5;
+  }
+
+  return (int) (x + half);
+}
+
+// bar height of the voltage, see BAR_LEVELS
+unsigned int bar_height(int volts) {
+  if (volts < (int) VOLTS_MIN) {
+    volts = VOLTS_MIN;
+  }
+  if (volts > (int) VOLTS_MAX) {
+    volts = VOLTS_MAX;
+  }
+
+  return 1 + round_to_int((volts - VOLTS_MIN) / VOLTS_STEP);
+}
+
+/*
+ * Builds BAR_LEVELS for the current screen height and voltage range, so that
+ * rendering a cell is a table lookup.
+ */
+void set_bar_levels() {
+  unsigned int count = VOLTS_MAX - VOLTS_MIN + 1;
+  struct bar_level* levels = realloc(BAR_LEVELS,
+      count * sizeof(struct bar_level));
+  unsigned int i;
+
+  if (levels == NULL) {
+    finish_screen(0);
+    perror("Failed to allocate bar levels");
+    exit(EXIT_FAILURE);
+  }
+  BAR_LEVELS = levels;
+
+  for (i = 0; i < count; i++) {
+    levels[i].height = bar_height(VOLTS_MIN + i);
+  }
+}
+
+void print_help(char* program_name) {
+  printf("Usage: %s SOURCE... [options]...\n", program_name);
+  printf("       %s --device=DEVICE [SOURCE]... [options]...\n", program_name);
+  printf("       %s --benchmark [SOURCE] [options]...\n", program_name);
+  printf("       %s --generate [FILE] [options]...\n\n", program_name);
+  printf("A SOURCE is a file, a serial port, a pipe, a unix socket or\n");
+  printf("tcp:HOST:PORT. Several sources are read together and shown in\n");
+  printf("tabs, which Tab, Shift-Tab and the keys 0 to 9 switch between,\n");
+  printf("0 being a summary of all of them.\n\n");
+  printf("  --config=FILE                read options from this file, a line\n");
+  printf("                               each of NAME=VALUE or NAME, with\n");
+  printf("                               source=SOURCE for sources and # for\n");
+  printf("                               comments; later options override it\n");
+  printf("  --output-file=FILE           append input file lines to this file\n");
+  printf("  --output-format=FORMAT       output file format: text or binary\n");
+  printf("  --publish=ADDRESS            send parsed frames in binary to\n");
+  printf("                               udp:HOST:PORT, which can be a multicast\n");
+  printf("                               group, or to a collector at\n");
+  printf("                               tcp:HOST:PORT\n");
+  printf("  --screen-height=NUMBER       screen height, in lines, the terminal\n");
+  printf("                               height by default\n");
+  printf("  --bar-width=NUMBER           voltage value bar width, in columns\n");
+  printf("  --space-between-bars=NUMBER  space between voltage value bars,\n");
+  printf("                               in columns\n");
+  printf("  --volts-min=NUMBER           min voltage value used on the screen,\n");
+  printf("                               in volts\n");
+  printf("  --volts-max=NUMBER           max voltage value used on the screen,\n");
+  printf("                               in volts\n");
+  printf("  --max-line-length=NUMBER     max length of line that is read from\n");
+  printf("                               a followed file or a device, in bytes\n");
+  printf("  --max-cell-step=NUMBER       cells that change more than this from\n");
+  printf("                               a frame to the next are out of range\n");
+  printf("                               and keep their last value for up to\n");
+  printf("                               %d frames, in volts, 0 for none\n",
+      MAX_HELD_FRAMES);
+  printf("  --frame-interval=NUMBER      time interval between reading next\n");
+  printf("                               frame, in milliseconds\n");
+  printf("  --pace=SOURCE                replay frames at the pace of interval\n");
+  printf("                               (--frame-interval), timestamps (of a\n");
+  printf("                               binary capture) or counters (T seconds,\n");
+  printf("                               minutes, hours)\n");
+  printf("  --speed=FACTOR               replay speed for --pace, or max\n");
+  printf("  --start-at=FRAME|[[H:]M:]S   start at this frame number, or at the\n");
+  printf("                               first frame with the T counters at this\n");
+  printf("                               time, using an index kept in\n");
+  printf("                               SOURCE.index; Home, End, Page Up and\n");
+  printf("                               Page Down jump while SOURCE is read\n");
+  printf("  --benchmark                  time the parser, the screen and the\n");
+  printf("                               output file on SOURCE and on generated\n");
+  printf("                               lines instead of showing them\n");
+  printf("  --generate                   write lines like a charger's to FILE,\n");
+  printf("                               a pipe or a terminal, or to stdout,\n");
+  printf("                               to load a monitor that reads them\n");
+  printf("  --generate-packs=NUMBER      packs of the generated lines, 2 by\n");
+  printf("                               default\n");
+  printf("  --generate-cells=NUMBER      cells of every pack, 6 by default\n");
+  printf("  --generate-noise=NUMBER      most a generated cell jumps around, in\n");
+  printf("                               volts, 0.2 by default\n");
+  printf("  --generate-errors=NUMBER     percent of the generated lines that\n");
+  printf("                               are damaged, 0 by default\n");
+  printf("  --generate-rate=NUMBER       generated frames a second, or 0 for as\n");
+  printf("                               fast as the reader takes them, 10 by\n");
+  printf("                               default\n");
+  printf("  --generate-frames=NUMBER     stop after this many frames, 0 for\n");
+  printf("                               when stopped, the default\n");
+  printf("  --status                     show the rates of the parser and the\n");
+  printf("                               screen on a status line, which the\n");
+  printf("                               's' key also turns on and off\n");
+  printf("  --history                    show the lowest voltage of every cell\n");
+  printf("                               by second instead of the bars, which\n");
+  printf("                               the 'h' key switches to by minute, by\n");
+  printf("                               hour and back to the bars\n");
+  printf("  --cell-stats[=LIST]          show rows under the bars with the\n");
+  printf("                               deviation of every cell from the mean\n");
+  printf("                               of its pack, its moving average over\n");
+  printf("                               about a minute (ewma) and its change\n");
+  printf("                               per minute (rate), all of them or the\n");
+  printf("                               ones in LIST; the 'c' key shows and\n");
+  printf("                               hides them\n");
+  printf("  --stats                      print the counters of the parser and\n");
+  printf("                               the screen at exit, as SIGUSR1 does\n");
+  printf("  --refresh-interval=NUMBER    time interval between screen updates,\n");
+  printf("                               in milliseconds\n");
+  printf("  --renderer=RENDERER          what draws the screen: curses, or ansi\n");
+  printf("                               for the changes of every update in one\n");
+  printf("                               write of escape sequences\n");
+  printf("  --follow                     keep reading data appended to SOURCE,\n");
+  printf("                               also across truncation and rotation\n");
+  printf("  --device=DEVICE              read data from this serial port\n");
+  printf("                               instead of SOURCE\n");
+  printf("  --baud=NUMBER                serial port speed, in bits per second\n");
+  printf("  --fsync=POLICY               when output file data is flushed to the\n");
+  printf("                               disk: never, interval or every write\n");
+  printf("  --fsync-interval=NUMBER      time interval between flushes with\n");
+  printf("                               --fsync=interval, in milliseconds\n");
+  printf("  --report[=FORMAT]            print statistics of SOURCE instead of\n");
+  printf("                               showing it, as a table or as json\n");
+  printf("  --export=FILE                convert SOURCE to FILE in columns, with\n");
+  printf("                               each value of the frames delta encoded\n");
+  printf("                               in row groups, instead of showing it\n");
+  printf("  --jobs=NUMBER                threads that --report parses with, one\n");
+  printf("                               per processor by default\n");
+  printf("  --low-volts=NUMBER           report time below this voltage, in volts,\n");
+  printf("                               --volts-min by default\n");
+  printf("  --high-volts=NUMBER          report time above this voltage, in volts,\n");
+  printf("                               --volts-max by default\n");
+  printf("  --warning-low=NUMBER         show cells below this voltage yellow,\n");
+  printf("                               in volts\n");
+  printf("  --warning-high=NUMBER        show cells above this voltage yellow,\n");
+  printf("                               in volts\n");
+  printf("  --critical-low=NUMBER        show cells below this voltage red,\n");
+  printf("                               in volts\n");
+  printf("  --critical-high=NUMBER       show cells above this voltage red,\n");
+  printf("                               in volts\n");
+  printf("  --hysteresis=NUMBER          how far back a cell must go to leave\n");
+  printf("                               an alarm, in volts\n");
+  printf("  --alarm-hook=COMMAND         run this shell command, with the alarm\n");
+  printf("                               level, cell number, voltage and source\n");
+  printf("                               as arguments, whenever a cell changes\n");
+  printf("                               level\n");
+  printf("  --alarm-exit=NUMBER          stop and exit with this status when\n");
+  printf("                               a cell goes critical\n");
+  printf("  --max-packs=NUMBER           max number of battery packs in a line,\n");
+  printf("                               taken from the first line by default\n");
+  printf("  --max-cells=NUMBER           max number of values in a section of\n");
+  printf("                               a pack, taken from the first line by\n");
+  printf("                               default\n");
+}
+
+// takes a list of the names in CELL_STAT_NAMES, all of them without one
+bool parse_cell_stats(const char* value) {
+  const char* name = value;
+  unsigned int i;
+
+  if (value == NULL) {
+    CELL_STATS = (1 << CELL_STAT_COUNT) - 1;
+    return true;
+  }
+
+  CELL_STATS = 0;
+  while (*name != '\0') {
+    size_t length = strcspn(name, ",");
+
+    for (i = 0; i < CELL_STAT_COUNT; i++) {
+      if (strlen(CELL_STAT_NAMES[i]) == length
+          && strncmp(name, CELL_STAT_NAMES[i], length) == 0) {
+        CELL_STATS |= 1 << i;
+        break;
+      }
+    }
+    if (i == CELL_STAT_COUNT) {
+      return false;
+    }
+    name += length + (name[length] == ',' ? 1 : 0);
+  }
+  return CELL_STATS != 0;
+}
+
+// takes a frame number, or a time of the counters as [[H:]M:]S
+bool parse_start_at(const char* value) {
+  unsigned long parts[3];
+  unsigned int count = 0;
+  const char* part = value;
+  char* end;
+
+  for (;;) {
+    if (*part < '0' || *part > '9') {
+      return false;
+    }
+    parts[count++] = strtoul(part, &end, 10);
+    if (*end == '\0') {
+      break;
+    }
+    if (*end != ':' || count == 3) {
+      return false;
+    }
+    part = end + 1;
+  }
+
+  if (count == 1) {
+    START_AT_FRAME = parts[0];
+    START_AT_TIME = -1;
+    return parts[0] > 0;
+  }
+  START_AT_FRAME = 0;
+
+  int64_t seconds = 0;
+  unsigned int i;
+  for (i = 0; i < count; i++) {
+    seconds = seconds * 60 + parts[i];
+  }
+  START_AT_TIME = seconds * 1000000;
+  return true;
+}
+
+void set_options(int argc, char** argv) {
+
+  bool failure = false;
+
+  for (;;) {
+    int option_index = 0;
+
+    int c = getopt_long_only(argc, argv, "", OPTIONS, &option_index);
+    if (c == -1) {
+      break;
+    }
+
+    failure |= !set_option(c, optarg);
+  }
+  for (; optind < argc; optind++) {
+    add_text(&SOURCE_PATHS, &SOURCE_PATH_COUNT, argv[optind]);
+  }
+
+  if (PACE == PACE_NONE && FRAME_INTERVAL > 0) {
+    PACE = PACE_INTERVAL;
+  }
+  failure |= (PACE == PACE_INTERVAL && FRAME_INTERVAL == 0);
+
+  if (failure || VOLTS_MAX <= VOLTS_MIN) {
+    print_help(*argv);
+    exit(EXIT_FAILURE);
+  }
+
+  if (LOW_VOLTS < 0) {
+    LOW_VOLTS = VOLTS_MIN;
+  }
+  if (HIGH_VOLTS < 0) {
+    HIGH_VOLTS = VOLTS_MAX;
+  }
+
+  set_screen_layout();
+}
+
+/*
+ * Sets the option of OPTIONS with the id to the value, NULL for options
+ * without one. Returns false if the value is not valid for the option.
+ */
+bool set_option(int option, char* value) {
+  bool failure = false;
+  int number = 0;
+
+  switch (option) {
+  case 1:
+    failure |= !parse_number(value, 1, INT_MAX, &number);
+    SCREEN_HEIGHT = number;
+    SCREEN_HEIGHT_SET = true;
+    break;
+
+  case 2:
+    failure |= !parse_number(value, 1, INT_MAX, &number);
+    BAR_WIDTH = number;
+    break;
+
+  case 3:
+    failure |= !parse_number(value, 0, INT_MAX, &number);
+    SPACE_BETWEEN_BARS = number;
+    break;
+
+  case 4:
+    failure |= !parse_number(value, 0, INT_MAX / 10, &number);
+    VOLTS_MIN = 10 * number;
+    break;
+
+  case 5:
+    failure |= !parse_number(value, 0, INT_MAX / 10, &number);
+    VOLTS_MAX = 10 * number;
+    break;
+
+  case 6:
+    failure |= !parse_number(value, 1, INT_MAX, &number);
+    MAX_LINE_LENGTH = number;
+    break;
+
+  case 7:
+    failure |= !parse_number(value, 0, INT_MAX / 1000, &number);
+    FRAME_INTERVAL = 1000 * number;
+    break;
+
+  case 8:
+    OUTPUT_FILE = value;
+    break;
+
+  case 9:
+    failure = true;
+    break;
+
+  case 10:
+    failure |= !parse_number(value, 1, INT_MAX, &number);
+    MAX_PACKS = number;
+    break;
+
+  case 11:
+    failure |= !parse_number(value, 1, INT_MAX, &number);
+    MAX_CELLS = number;
+    break;
+
+  case 12:
+    FOLLOW = true;
+    break;
+
+  case 13:
+    DEVICE = value;
+    break;
+
+  case 14:
+    failure |= !parse_number(value, 0, INT_MAX, &number);
+    BAUD = number;
+    if (baud_to_speed(BAUD) == B0) {
+      failure = true;
+    }
+    break;
+
+  case 15:
+    failure |= !parse_number(value, 0, INT_MAX / 1000, &number);
+    REFRESH_INTERVAL = 1000 * number;
+    break;
+
+  case 16:
+    if (strcmp(value, "never") == 0) {
+      FSYNC_POLICY = FSYNC_NEVER;
+    } else if (strcmp(value, "interval") == 0) {
+      FSYNC_POLICY = FSYNC_INTERVAL;
+    } else if (strcmp(value, "every") == 0) {
+      FSYNC_POLICY = FSYNC_EVERY;
+    } else {
+      failure = true;
+    }
+    break;
+
+  case 17:
+    failure |= !parse_number(value, 0, INT_MAX, &number);
+    FSYNC_INTERVAL_MS = number;
+    break;
+
+  case 18:
+    if (strcmp(value, "text") == 0) {
+      OUTPUT_FORMAT = OUTPUT_TEXT;
+    } else if (strcmp(value, "binary") == 0) {
+      OUTPUT_FORMAT = OUTPUT_BINARY;
+    } else {
+      failure = true;
+    }
+    break;
+
+  case 19:
+    if (value == NULL || strcmp(value, "table") == 0) {
+      REPORT = REPORT_TABLE;
+    } else if (strcmp(value, "json") == 0) {
+      REPORT = REPORT_JSON;
+    } else {
+      failure = true;
+    }
+    break;
+
+  case 20:
+    LOW_VOLTS = parse_volts(value);
+    failure |= (LOW_VOLTS < 0);
+    break;
+
+  case 21:
+    HIGH_VOLTS = parse_volts(value);
+    failure |= (HIGH_VOLTS < 0);
+    break;
+
+  case 22:
+    failure |= !parse_number(value, 0, INT_MAX, &number);
+    JOBS = number;
+    break;
+
+  case 30:
+    if (strcmp(value, "interval") == 0) {
+      PACE = PACE_INTERVAL;
+    } else if (strcmp(value, "timestamps") == 0) {
+      PACE = PACE_TIMESTAMPS;
+    } else if (strcmp(value, "counters") == 0) {
+      PACE = PACE_COUNTERS;
+    } else {
+      failure = true;
+    }
+    break;
+
+  case 31:
+    if (strcmp(value, "max") == 0) {
+      SPEED = 0;
+    } else {
+      failure |= !parse_factor(value, &SPEED);
+    }
+    break;
+
+  case 32:
+    BENCHMARK = true;
+    break;
+
+  case 33:
+    SHOW_STATUS = true;
+    break;
+
+  case 34:
+    PRINT_STATS = true;
+    break;
+
+  case 35:
+    PUBLISH = value;
+    break;
+
+  case 36:
+    SHOWN_HISTORY = 0;
+    break;
+
+  case 37:
+    failure |= !parse_start_at(value);
+    break;
+
+  case 38:
+    failure |= !parse_cell_stats(value);
+    SHOWN_CELL_STATS = CELL_STATS;
+    break;
+
+  case 39:
+    EXPORT_FILE = value;
+    break;
+
+  case 40:
+    if (strcmp(value, "curses") == 0) {
+      RENDERER = RENDERER_CURSES;
+    } else if (strcmp(value, "ansi") == 0) {
+      RENDERER = RENDERER_ANSI;
+    } else {
+      failure = true;
+    }
+    break;
+
+  case 41:
+    MAX_CELL_STEP = parse_volts(value);
+    failure |= (MAX_CELL_STEP < 0);
+    break;
+
+  case 42:
+    read_config(value);
+    break;
+
+  case 43:
+    GENERATE = true;
+    break;
+
+  case 44:
+    failure |= !parse_number(value, 1, 1000, &number);
+    GENERATE_PACKS = number;
+    break;
+
+  case 45:
+    failure |= !parse_number(value, 1, 1000, &number);
+    GENERATE_CELLS = number;
+    break;
+
+  case 46:
+    number = parse_volts(value);
+    failure |= (number < 0);
+    GENERATE_NOISE = number;
+    break;
+
+  case 47:
+    failure |= !parse_number(value, 0, 100, &number);
+    GENERATE_ERRORS = number;
+    break;
+
+  case 48:
+    failure |= !parse_number(value, 0, 1000000, &number);
+    GENERATE_RATE = number;
+    break;
+
+  case 49:
+    failure |= !parse_number(value, 0, INT_MAX, &number);
+    GENERATE_FRAMES = number;
+    break;
+
+  case 23:
+    WARNING_LOW_VOLTS = parse_volts(value);
+    failure |= (WARNING_LOW_VOLTS < 0);
+    break;
+
+  case 24:
+    WARNING_HIGH_VOLTS = parse_volts(value);
+    failure |= (WARNING_HIGH_VOLTS < 0);
+    break;
+
+  case 25:
+    CRITICAL_LOW_VOLTS = parse_volts(value);
+    failure |= (CRITICAL_LOW_VOLTS < 0);
+    break;
+
+  case 26:
+    CRITICAL_HIGH_VOLTS = parse_volts(value);
+    failure |= (CRITICAL_HIGH_VOLTS < 0);
+    break;
+
+  case 27:
+    ALARM_HYSTERESIS = parse_volts(value);
+    failure |= (ALARM_HYSTERESIS < 0);
+    break;
+
+  case 28:
+    ALARM_HOOK = value;
+    break;
+
+  case 29:
+    failure |= !parse_number(value, 1, 255, &number);
+    ALARM_EXIT_STATUS = number;
+    break;
+
+  case '?':
+    failure = true;
+    break;
+
+  default:
+    failure = true;
+  }
+
+  return !failure;
+}
+
+/*
+ * Reads options from a file, a line each: NAME=VALUE, or NAME for options
+ * without a value, with the names of the command line options. Lines of
+ * "source=SOURCE" add sources, and lines that start with '#' are comments.
+ * A line that is not an option stops the program.
+ */
+void read_config(const char* file_name) {
+  FILE* file = fopen(file_name, "r");
+  char* line = NULL;
+  size_t size = 0;
+  unsigned int line_number = 0;
+
+  if (file == NULL) {
+    perror("Failed to open config file");
+    exit(EXIT_FAILURE);
+  }
+
+  while (getline(&line, &size, file) != -1) {
+    char* name = trim(line);
+    char* value = strchr(name, '=');
+    const struct option* option;
+
+    line_number++;
+    if (*name == '\0' || *name == '#') {
+      continue;
+    }
+    if (value != NULL) {
+      *value = '\0';
+      value = strdup(trim(value + 1));
+      name = trim(name);
+      if (value == NULL) {
+        perror("Failed to read config file");
+        exit(EXIT_FAILURE);
+      }
+    }
+
+    if (strcmp(name, "source") == 0 && value != NULL) {
+      add_text(&SOURCE_PATHS, &SOURCE_PATH_COUNT, value);
+      continue;
+    }
+    if (value != NULL) {
+      add_text(&CONFIG_VALUES, &CONFIG_VALUE_COUNT, value);
+    }
+    for (option = OPTIONS; option->name != NULL; option++) {
+      if (strcmp(option->name, name) == 0) {
+        break;
+      }
+    }
+    if (option->name == NULL || option->val == 42) {
+      printf("%s:%u: unknown option %s\n", file_name, line_number, name);
+      exit(EXIT_FAILURE);
+    }
+    if ((option->has_arg == 0 && value != NULL)
+        || (option->has_arg == 1 && value == NULL)
+        || !set_option(option->val, value)) {
+      printf("%s:%u: invalid %s\n", file_name, line_number, name);
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  free(line);
+  fclose(file);
+}
+
+// the text without the white space around it, which is cut off in place
+char* trim(char* text) {
+  char* end;
+
+  while (*text != '\0' && strchr(WHITE_SPACE_CHARS, *text) != NULL) {
+    text++;
+  }
+  end = text + strlen(text);
+  while (end > text && strchr(WHITE_SPACE_CHARS, end[-1]) != NULL) {
+    end--;
+  }
+  *end = '\0';
+  return text;
+}
+
+void add_text(char*** texts, unsigned int* count, char* text) {
+  char** grown = realloc(*texts, (*count + 1) * sizeof(char*));
+  if (grown == NULL) {
+    perror("Failed to allocate options");
+    exit(EXIT_FAILURE);
+  }
+  *texts = grown;
+  (*texts)[(*count)++] = text;
+}
+
+// reads a whole number from min to max, false if the text is not one
+bool parse_number(const char* text, int min, int max, int* number) {
+  char* end;
+  long value;
+
+  errno = 0;
+  value = strtol(text, &end, 10);
+  if (end == text || *end != '\0' || errno != 0 || value < min
+      || value > max) {
+    return false;
+  }
+  *number = value;
+  return true;
+}
+
+// parses a whole text as a finite factor above 0
+bool parse_factor(const char* text, double* factor) {
+  char* end;
+  double value;
+
+  errno = 0;
+  value = strtod(text, &end);
+  if (end == text || *end != '\0' || errno != 0 || !isfinite(value)
+      || value <= 0) {
+    return false;
+  }
+  *factor = value;
+  return true;
+}
+
+// scale of the bars for SCREEN_HEIGHT, when it is set and on every resize
+void set_screen_layout() {
+  OFFSET_BOTTOM = 3 + __builtin_popcount(SHOWN_CELL_STATS);
+  OFFSET_TOP = SCREEN_HEIGHT - 1;
+  if (OFFSET_TOP < OFFSET_BOTTOM + 1) {
+    OFFSET_TOP = OFFSET_BOTTOM + 1;
+  }
+  VOLTS_STEP = (double) (VOLTS_MAX - VOLTS_MIN) / (OFFSET_TOP - OFFSET_BOTTOM);
+  set_bar_levels();
+
+  unsigned int rows = OFFSET_TOP - OFFSET_BOTTOM + 2;
+  unsigned int i;
+  int* rows_of_bars = realloc(bar_rows, rows * sizeof(int));
+  if (rows_of_bars == NULL) {
+    finish_screen(0);
+    perror("Failed to allocate bars");
+    exit(EXIT_FAILURE);
+  }
+  bar_rows = rows_of_bars;
+  for (i = 0; i < rows; i++) {
+    bar_rows[i] = SCREEN_HEIGHT - OFFSET_BOTTOM + 1 - i;
+  }
+}
+
+FILE* open_file(char* fileName, char* mode) {
+  FILE* file = fopen(fileName, mode);
+  if (file == NULL) {
+    finish_screen(0);
+    perror("Failed to open file");
+    exit(EXIT_FAILURE);
+  }
+
+  return file;
+}
+
+void close_file(FILE* file) {
+  fclose(file);
+}
+
+// sets up everything but the file descriptor
+void init_reader(struct line_reader* reader, char* path) {
+  reader->path = path;
+  reader->fd = -1;
+  reader->offset = 0;
+  reader->size = READ_BUFFER_SIZE > 2 * MAX_LINE_LENGTH ? READ_BUFFER_SIZE
+      : 2 * MAX_LINE_LENGTH;
+  reader->start = 0;
+  reader->end = 0;
+  reader->split_position = 0;
+  reader->split_char = '\0';
+  reader->repeat_line = NULL;
+  reader->follow = false;
+  reader->device = false;
+  reader->stream = false;
+  reader->binary = false;
+  reader->layout.counts = NULL;
+  reader->map = NULL;
+  reader->map_size = 0;
+  reader->map_offset = 0;
+  reader->inotify_fd = -1;
+  reader->watch = -1;
+
+  reader->buffer = malloc(reader->size);
+  if (reader->buffer == NULL) {
+    finish_screen(0);
+    perror("Failed to allocate read buffer");
+    exit(EXIT_FAILURE);
+  }
+}
+
+/*
+ * Opens the file for reading lines, or frames if it is a capture file. A
+ * regular text file that is not followed is mapped into memory. A followed
+ * file is read from its last lines on, so that the screen shows the latest
+ * frame right away.
+ */
+void open_reader(struct line_reader* reader, char* path, bool follow) {
+  init_reader(reader, path);
+  reader->follow = follow;
+
+  reader->fd = open(path, O_RDONLY);
+  if (reader->fd == -1) {
+    finish_screen(0);
+    perror("Failed to open file");
+    exit(EXIT_FAILURE);
+  }
+
+  struct stat st;
+  if (fstat(reader->fd, &st) == 0 && S_ISREG(st.st_mode)
+      && read_capture_header(reader->fd, &reader->layout)) {
+    reader->binary = true;
+    reader->offset = lseek(reader->fd, capture_header_size(&reader->layout),
+        SEEK_SET);
+  }
+
+  if (!follow) {
+    if (!reader->binary && S_ISREG(st.st_mode) && st.st_size > 0) {
+      map_reader(reader, st.st_size);
+    }
+    return;
+  }
+
+  reader->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  watch_file(reader);
+
+  if (reader->binary) {
+    size_t header_size = capture_header_size(&reader->layout);
+    size_t record_size = capture_record_size(&reader->layout);
+
+    if (st.st_size >= header_size + record_size) {
+      off_t records = (st.st_size - header_size) / record_size;
+      reader->offset = lseek(reader->fd, header_size + (records - 1)
+          * record_size, SEEK_SET);
+    }
+  } else if (S_ISREG(st.st_mode) && st.st_size > MAX_LINE_LENGTH) {
+    reader->offset = lseek(reader->fd, st.st_size - MAX_LINE_LENGTH, SEEK_SET);
+
+    // skip the partial line the tail starts with
+    char* line;
+    read_line(reader, &line);
+  }
+}
+
+/*
+ * Opens the serial port in raw mode for reading lines without blocking.
+ * Partial lines are kept until the rest of them arrives, like when following.
+ */
+void open_device_reader(struct line_reader* reader, char* path,
+    unsigned int baud) {
+  struct termios tty;
+
+  init_reader(reader, path);
+  reader->follow = true;
+  reader->device = true;
+
+  // a pipe is opened for writing too, so that it stays open between writers
+  struct stat st;
+  bool pipe = stat(path, &st) == 0 && S_ISFIFO(st.st_mode);
+
+  reader->fd = open(path, (pipe ? O_RDWR : O_RDONLY) | O_NOCTTY | O_NONBLOCK);
+  if (reader->fd == -1) {
+    finish_screen(0);
+    perror("Failed to open device");
+    exit(EXIT_FAILURE);
+  }
+
+  if (tcgetattr(reader->fd, &tty) == 0) {
+    cfmakeraw(&tty);
+    tty.c_cflag |= CLOCAL | CREAD;
+    tty.c_cc[VMIN] = 0;
+    tty.c_cc[VTIME] = 0;
+    cfsetispeed(&tty, baud_to_speed(baud));
+    cfsetospeed(&tty, baud_to_speed(baud));
+
+    if (tcsetattr(reader->fd, TCSANOW, &tty) != 0) {
+      finish_screen(0);
+      perror("Failed to configure device");
+      exit(EXIT_FAILURE);
+    }
+    tcflush(reader->fd, TCIFLUSH);
+  }
+}
+
+/*
+ * Connects to a socket that sends lines, tcp:HOST:PORT or the path of a unix
+ * socket, and reads it without blocking like a serial port until it closes.
+ */
+void open_socket_reader(struct line_reader* reader, char* spec) {
+  init_reader(reader, spec);
+  reader->follow = true;
+  reader->device = true;
+  reader->stream = true;
+
+  if (strncmp(spec, "tcp:", 4) == 0) {
+    struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype =
+        SOCK_STREAM };
+    struct addrinfo* addresses;
+    struct addrinfo* address;
+    char host[256];
+    char* port = strrchr(spec + 4, ':');
+
+    if (port == NULL || port - (spec + 4) >= (int) sizeof(host)) {
+      finish_screen(0);
+      fprintf(stderr, "Failed to connect to %s: use tcp:HOST:PORT\n", spec);
+      exit(EXIT_FAILURE);
+    }
+    memcpy(host, spec + 4, port - (spec + 4));
+    host[port - (spec + 4)] = '\0';
+
+    int error = getaddrinfo(host, port + 1, &hints, &addresses);
+    if (error != 0) {
+      finish_screen(0);
+      fprintf(stderr, "Failed to connect to %s: %s\n", spec,
+          gai_strerror(error));
+      exit(EXIT_FAILURE);
+    }
+    for (address = addresses; address != NULL; address = address->ai_next) {
+      reader->fd = socket(address->ai_family, address->ai_socktype
+          | SOCK_CLOEXEC, address->ai_protocol);
+      if (reader->fd != -1 && connect(reader->fd, address->ai_addr,
+          address->ai_addrlen) == 0) {
+        break;
+      }
+      if (reader->fd != -1) {
+        close(reader->fd);
+        reader->fd = -1;
+      }
+    }
+    freeaddrinfo(addresses);
+  } else {
+    struct sockaddr_un address = { .sun_family = AF_UNIX };
+
+    strncpy(address.sun_path, spec, sizeof(address.sun_path) - 1);
+    reader->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (reader->fd != -1 && connect(reader->fd, (struct sockaddr*) &address,
+        sizeof(address)) != 0) {
+      close(reader->fd);
+      reader->fd = -1;
+    }
+  }
+
+  if (reader->fd == -1) {
+    finish_screen(0);
+    perror("Failed to connect to socket");
+    exit(EXIT_FAILURE);
+  }
+  fcntl(reader->fd, F_SETFL, fcntl(reader->fd, F_GETFL) | O_NONBLOCK);
+}
+
+/*
+ * Opens a source by what it is: a socket, or a file, which is read as a
+ * serial port if it is a terminal or a pipe and several sources are read
+ * together, since those must not block the others.
+ */
+void open_source(struct ingest* ingest, char* path) {
+  struct stat st;
+
+  if (strncmp(path, "tcp:", 4) == 0 || (stat(path, &st) == 0
+      && S_ISSOCK(st.st_mode))) {
+    open_socket_reader(&ingest->reader, path);
+  } else if (ingest->multiplexed && stat(path, &st) == 0
+      && (S_ISCHR(st.st_mode) || S_ISFIFO(st.st_mode))) {
+    open_device_reader(&ingest->reader, path, BAUD);
+  } else {
+    open_reader(&ingest->reader, path, FOLLOW);
+  }
+}
+
+// returns B0 for speeds that termios does not have
+speed_t baud_to_speed(unsigned int baud) {
+  switch (baud) {
+  case 1200:
+    return B1200;
+  case 2400:
+    return B2400;
+  case 4800:
+    return B4800;
+  case 9600:
+    return B9600;
+  case 19200:
+    return B19200;
+  case 38400:
+    return B38400;
+  case 57600:
+    return B57600;
+  case 115200:
+    return B115200;
+  case 230400:
+    return B230400;
+  case 460800:
+    return B460800;
+  case 921600:
+    return B921600;
+  default:
+    return B0;
+  }
+}
+
+/*
+ * Maps the whole file for sequential reading. If it cannot be mapped, for
+ * example when it does not fit in the address space, it is read as usual.
+ */
+void map_reader(struct line_reader* reader, size_t size) {
+  void* map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, reader->fd, 0);
+  if (map == MAP_FAILED) {
+    return;
+  }
+
+  madvise(map, size, MADV_SEQUENTIAL);
+  reader->map = map;
+  reader->map_size = size;
+  reader->map_offset = 0;
+}
+
+/*
+ * Returns the next line of a mapped file as [begin, end), without the
+ * newline. Lines have no length limit and are not changed.
+ */
+int read_mapped_line(struct line_reader* reader, const char** begin,
+    const char** end) {
+  size_t left = reader->map_size - reader->map_offset;
+
+  if (left == 0) {
+    return READ_EOF;
+  }
+
+  *begin = reader->map + reader->map_offset;
+  *end = memchr(*begin, '\n', left);
+  if (*end == NULL) {
+    *end = *begin + left;
+  }
+  reader->map_offset = *end - reader->map + (*end < *begin + left ? 1 : 0);
+  reader->offset = reader->map_offset;
+
+  return READ_LINE;
+}
+
+void close_reader(struct line_reader* reader) {
+  if (reader->map != NULL) {
+    munmap((void*) reader->map, reader->map_size);
+  }
+  if (reader->inotify_fd != -1) {
+    close(reader->inotify_fd);
+  }
+  close(reader->fd);
+  free(reader->buffer);
+  free_layout(&reader->layout);
+}
+
+/*
+ * Returns the next line in line, or READ_EOF if there is no complete line
+ * left. Lines longer than MAX_LINE_LENGTH are split like fgets() does.
+ */
+int read_line(struct line_reader* reader, char** line) {
+  size_t max_line = MAX_LINE_LENGTH - 1;
+
+  if (reader->repeat_line != NULL) {
+    *line = reader->repeat_line;
+    reader->repeat_line = NULL;
+    return READ_LINE;
+  }
+
+  if (reader->split_char != '\0') {
+    reader->buffer[reader->split_position] = reader->split_char;
+    reader->split_char = '\0';
+  }
+
+  for (;;) {
+    char* begin = reader->buffer + reader->start;
+    size_t available = reader->end - reader->start;
+
+    char* newline = memchr(begin, '\n', available < max_line ? available
+        : max_line);
+    if (newline != NULL) {
+      *newline = '\0';
+      reader->start += newline - begin + 1;
+      *line = begin;
+      return READ_LINE;
+    }
+
+    if (available >= max_line) {
+      reader->split_position = reader->start + max_line;
+      reader->split_char = begin[max_line];
+      begin[max_line] = '\0';
+      reader->start += max_line;
+      *line = begin;
+      return READ_LINE;
+    }
+
+    ssize_t n = fill_reader(reader);
+    if (n > 0) {
+      continue;
+    }
+
+    if (!reader->follow && n == 0 && available > 0) {
+      reader->buffer[reader->end] = '\0';
+      reader->start = reader->end;
+      *line = reader->buffer;
+      return READ_LINE;
+    }
+
+    return READ_EOF;
+  }
+}
+
+/*
+ * Keeps the unread data, moved to the start of the buffer, and reads more
+ * after it. Returns what read() returned, -1 only for EAGAIN and EINTR.
+ */
+ssize_t fill_reader(struct line_reader* reader) {
+  size_t available = reader->end - reader->start;
+
+  if (reader->start > 0) {
+    memmove(reader->buffer, reader->buffer + reader->start, available);
+    reader->start = 0;
+    reader->end = available;
+  }
+
+  ssize_t n = read(reader->fd, reader->buffer + reader->end,
+      reader->size - reader->end - 1);
+  if (n > 0) {
+    reader->end += n;
+    reader->offset += n;
+  } else if (n == 0 && reader->stream) {
+    // the socket is closed, what is left is the last line
+    reader->follow = false;
+  } else if (n == -1 && errno != EAGAIN && errno != EINTR) {
+    finish_screen(0);
+    perror("Failed to read file");
+    exit(EXIT_FAILURE);
+  }
+
+  return n;
+}
+
+/*
+ * Reads the next frame of a capture file, or returns READ_EOF if there is no
+ * complete frame left.
+ */
+int read_capture_frame(struct line_reader* reader, struct frame* frame) {
+  size_t record_size = capture_record_size(&reader->layout);
+
+  for (;;) {
+    if (reader->end - reader->start >= record_size) {
+      decode_capture_frame(&reader->layout, (unsigned char*) reader->buffer
+          + reader->start, frame);
+      reader->start += record_size;
+      return READ_LINE;
+    }
+
+    if (fill_reader(reader) <= 0) {
+      return READ_EOF;
+    }
+  }
+}
+
+/*
+ * Waits until the followed file changes, using inotify if it is available
+ * and polling otherwise. Handles truncation and rotation of the file.
+ */
+void wait_for_data(struct line_reader* reader) {
+  if (reader->device) {
+    struct pollfd pfd = { reader->fd, POLLIN, 0 };
+    poll(&pfd, 1, -1);
+    return;
+  }
+
+  if (reader->inotify_fd != -1) {
+    struct pollfd pfd = { reader->inotify_fd, POLLIN, 0 };
+
+    if (poll(&pfd, 1, FOLLOW_POLL_INTERVAL) > 0) {
+      drain_events(reader);
+    }
+  } else {
+    usleep(1000 * FOLLOW_POLL_INTERVAL);
+  }
+
+  check_followed_file(reader);
+}
+
+void drain_events(struct line_reader* reader) {
+  char events[4096];
+
+  while (read(reader->inotify_fd, events, sizeof(events)) > 0) {
+  }
+}
+
+// starts over on a truncated file and reopens a rotated one
+void check_followed_file(struct line_reader* reader) {
+  struct stat opened, named;
+  if (fstat(reader->fd, &opened) != 0) {
+    return;
+  }
+
+  if (S_ISREG(opened.st_mode) && opened.st_size < reader->offset) {
+    // truncated, start over
+    reader->offset = lseek(reader->fd, reader->binary
+        ? capture_header_size(&reader->layout) : 0, SEEK_SET);
+    reader->start = 0;
+    reader->end = 0;
+    return;
+  }
+
+  if (stat(reader->path, &named) == 0 && (named.st_ino != opened.st_ino
+      || named.st_dev != opened.st_dev) && opened.st_size <= reader->offset) {
+    // rotated, and the old file has been read to its end
+    reopen_reader(reader);
+  }
+}
+
+/*
+ * The descriptor that tells when a source has more input: the port or the
+ * socket, or the inotify descriptor of a followed file. Returns -1 for a file
+ * that is only replayed or checked every FOLLOW_POLL_INTERVAL.
+ */
+int source_fd(const struct line_reader* reader) {
+  if (reader->device) {
+    return reader->fd;
+  }
+  return reader->follow ? reader->inotify_fd : -1;
+}
+
+void reopen_reader(struct line_reader* reader) {
+  int fd = open(reader->path, O_RDONLY);
+  if (fd == -1) {
+    return;
+  }
+
+  close(reader->fd);
+  reader->fd = fd;
+  reader->offset = 0;
+  reader->start = 0;
+  reader->end = 0;
+
+  if (reader->binary) {
+    free_layout(&reader->layout);
+    reader->binary = read_capture_header(fd, &reader->layout);
+    if (reader->binary) {
+      reader->offset = lseek(fd, capture_header_size(&reader->layout),
+          SEEK_SET);
+    }
+  }
+
+  watch_file(reader);
+}
+
+// a file that is read from the start and not followed can jump
+bool reader_seekable(const struct line_reader* reader) {
+  return !reader->follow && (reader->map != NULL || reader->binary);
+}
+
+// offset of the next frame, or of the invalid lines before it
+uint64_t reader_position(const struct line_reader* reader) {
+  if (reader->map != NULL) {
+    return reader->map_offset;
+  }
+  return reader->offset - (reader->end - reader->start);
+}
+
+void set_reader_position(struct line_reader* reader, uint64_t position) {
+  if (reader->map != NULL) {
+    reader->map_offset = position;
+    reader->offset = position;
+    return;
+  }
+  reader->offset = lseek(reader->fd, position, SEEK_SET);
+  reader->start = 0;
+  reader->end = 0;
+}
+
+// reads the next valid frame of a seekable file, without counting it
+int read_indexed_frame(struct line_reader* reader, struct frame* frame) {
+  const char* begin;
+  const char* end;
+
+  if (reader->binary) {
+    return read_capture_frame(reader, frame);
+  }
+
+  do {
+    if (read_mapped_line(reader, &begin, &end) == READ_EOF) {
+      return READ_EOF;
+    }
+  } while (!parse_frame_range(begin, end, NULL, frame, NULL));
+  return READ_LINE;
+}
+
+/*
+ * Reads FILE.index, or builds the index and writes it there if FILE.index
+ * does not match the file. An index that cannot be written is kept only in
+ * memory.
+ */
+void load_file_index(struct ingest* ingest, struct frame* frame) {
+  struct line_reader* reader = &ingest->reader;
+  char path[PATH_MAX];
+  struct stat st;
+
+  bool named = fstat(reader->fd, &st) == 0 && snprintf(path, sizeof(path),
+      "%s.index", reader->path) < (int) sizeof(path);
+  if (named && read_file_index(&ingest->file_index, path, &st)) {
+    return;
+  }
+
+  build_file_index(ingest, frame);
+  if (named) {
+    write_file_index(&ingest->file_index, path, &st);
+  }
+}
+
+bool read_file_index(struct file_index* index, const char* path,
+    const struct stat* st) {
+  unsigned char header[INDEX_HEADER_SIZE];
+  unsigned char* entries = NULL;
+  unsigned int i;
+
+  int fd = open(path, O_RDONLY);
+  if (fd == -1) {
+    return false;
+  }
+
+  bool valid = read(fd, header, sizeof(header)) == sizeof(header)
+      && memcmp(header, INDEX_MAGIC, 4) == 0
+      && get_u16(header + 4) == INDEX_VERSION
+      && get_u16(header + 6) == INDEX_STRIDE
+      && get_u64(header + 8) == (uint64_t) st->st_size
+      && get_u64(header + 16) == modification_time(st);
+  if (valid) {
+    index->frame_count = get_u64(header + 24);
+    index->count = get_u32(header + 32);
+    index->ordered = (get_u32(header + 36) & INDEX_ORDERED) != 0;
+    index->capacity = index->count + 1;
+
+    // a frame takes a byte at least, and there is an entry every stride
+    valid = index->frame_count <= (uint64_t) st->st_size
+        && index->count <= (uint64_t) st->st_size / INDEX_STRIDE + 1
+        && index->count == (index->frame_count + INDEX_STRIDE - 1)
+        / INDEX_STRIDE;
+  }
+  if (valid) {
+
+    size_t size = (size_t) index->count * INDEX_ENTRY_SIZE;
+    entries = malloc(size + 1);
+    index->entries = malloc(index->capacity * sizeof(struct index_entry));
+    valid = entries != NULL && index->entries != NULL
+        && read(fd, entries, size) == (ssize_t) size;
+  }
+  for (i = 0; valid && i < index->count; i++) {
+    const unsigned char* in = entries + i * INDEX_ENTRY_SIZE;
+    struct index_entry* entry = &index->entries[i];
+
+    entry->frame = get_u64(in);
+    entry->offset = get_u64(in + 8);
+    entry->time = get_u64(in + 16);
+    // offsets that do not go up or leave the file would read past the map
+    valid = entry->frame == (uint64_t) i * INDEX_STRIDE + 1
+        && entry->offset < (uint64_t) st->st_size
+        && (i == 0 || (entry->offset > entry[-1].offset
+        && (!index->ordered || entry->time >= entry[-1].time)));
+  }
+  close(fd);
+  free(entries);
+
+  if (!valid) {
+    free(index->entries);
+    index->entries = NULL;
+  }
+  return valid;
+}
+
+// writes the index next to FILE.index and moves it over that when complete
+void write_file_index(const struct file_index* index, const char* path,
+    const struct stat* st) {
+  size_t size = INDEX_HEADER_SIZE + (size_t) index->count * INDEX_ENTRY_SIZE;
+  unsigned char* out = malloc(size);
+  char temporary[PATH_MAX];
+  unsigned int i;
+
+  if (out == NULL || snprintf(temporary, sizeof(temporary), "%s.tmp", path)
+      >= (int) sizeof(temporary)) {
+    free(out);
+    return;
+  }
+
+  memcpy(out, INDEX_MAGIC, 4);
+  put_u16(out + 4, INDEX_VERSION);
+  put_u16(out + 6, INDEX_STRIDE);
+  put_u64(out + 8, st->st_size);
+  put_u64(out + 16, modification_time(st));
+  put_u64(out + 24, index->frame_count);
+  put_u32(out + 32, index->count);
+  put_u32(out + 36, index->ordered ? INDEX_ORDERED : 0);
+  for (i = 0; i < index->count; i++) {
+    unsigned char* entry = out + INDEX_HEADER_SIZE + i * INDEX_ENTRY_SIZE;
+
+    put_u64(entry, index->entries[i].frame);
+    put_u64(entry + 8, index->entries[i].offset);
+    put_u64(entry + 16, index->entries[i].time);
+  }
+
+  int fd = open(temporary, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd != -1) {
+    bool written = (write(fd, out, size) == (ssize_t) size);
+    close(fd);
+    if (!written || rename(temporary, path) == -1) {
+      unlink(temporary);
+    }
+  }
+  free(out);
+}
+
+uint64_t modification_time(const struct stat* st) {
+  return st->st_mtim.tv_sec * 1000000000ULL + st->st_mtim.tv_nsec;
+}
+
+/*
+ * Reads the whole file for the index and goes back to where the reader was.
+ * The frames are parsed into frame, they are not counted as read.
+ */
+void build_file_index(struct ingest* ingest, struct frame* frame) {
+  struct line_reader* reader = &ingest->reader;
+  struct file_index* index = &ingest->file_index;
+  uint64_t position = reader_position(reader);
+  uint64_t count = 0;
+  int64_t last_time = INT64_MIN;
+
+  index->count = 0;
+  index->ordered = true;
+  index->capacity = 16;
+  index->entries = malloc(index->capacity * sizeof(struct index_entry));
+  if (index->entries == NULL) {
+    finish_screen(0);
+    perror("Failed to allocate index");
+    exit(EXIT_FAILURE);
+  }
+
+  set_reader_position(reader, reader->binary
+      ? capture_header_size(&reader->layout) : 0);
+  for (;;) {
+    uint64_t offset = reader_position(reader);
+
+    if (read_indexed_frame(reader, frame) == READ_EOF) {
+      break;
+    }
+    int64_t time = counter_time(frame);
+    if (count % INDEX_STRIDE == 0) {
+      add_index_entry(index, count + 1, offset, time);
+    }
+    index->ordered &= (time >= last_time);
+    last_time = time;
+    count++;
+  }
+  index->frame_count = count;
+  set_reader_position(reader, position);
+}
+
+void add_index_entry(struct file_index* index, uint64_t frame,
+    uint64_t offset, int64_t time) {
+  if (index->count == index->capacity) {
+    struct index_entry* entries = realloc(index->entries, 2 * index->capacity
+        * sizeof(struct index_entry));
+    if (entries == NULL) {
+      finish_screen(0);
+      perror("Failed to allocate index");
+      exit(EXIT_FAILURE);
+    }
+    index->entries = entries;
+    index->capacity *= 2;
+  }
+
+  index->entries[index->count].frame = frame;
+  index->entries[index->count].offset = offset;
+  index->entries[index->count].time = time;
+  index->count++;
+}
+
+/*
+ * Makes the jump that the screen asked for, so that the next frame read is
+ * the one jumped to, and lets it show right away. Inputs that cannot seek
+ * ignore jumps.
+ */
+void jump(struct ingest* ingest, struct frame* frame) {
+  enum jump request = atomic_exchange_explicit(&ingest->jump, JUMP_NONE,
+      memory_order_relaxed);
+  struct file_index* index = &ingest->file_index;
+  uint64_t number = ingest->frame_number;
+
+  if (!reader_seekable(&ingest->reader)) {
+    return;
+  }
+  if (index->entries == NULL) {
+    load_file_index(ingest, frame);
+  }
+  uint64_t step = index->frame_count / JUMP_FRACTION > 0
+      ? index->frame_count / JUMP_FRACTION : 1;
+
+  switch (request) {
+  case JUMP_START_AT:
+    seek_frame(ingest, frame, START_AT_FRAME, START_AT_TIME);
+    break;
+  case JUMP_FIRST:
+    seek_frame(ingest, frame, 1, -1);
+    break;
+  case JUMP_BACK:
+    seek_frame(ingest, frame, number > step ? number - step : 1, -1);
+    break;
+  case JUMP_FORWARD:
+    seek_frame(ingest, frame, number + step, -1);
+    break;
+  case JUMP_LAST:
+    seek_frame(ingest, frame, index->frame_count, -1);
+    break;
+  default:
+    return;
+  }
+  ingest->jumped |= (request != JUMP_START_AT);
+  ingest->pacer.started = false;
+  // the frame before the jump has nothing to repair the next one with
+  ingest->previous.pack_count = 0;
+  ingest->previous.sections[SECTION_T].count = 0;
+}
+
+/*
+ * Moves the reader to frame number, or when time is not -1 to the first frame
+ * with its counters at that time or later. Goes to the index entry before it,
+ * then on frame by frame. Past the end is the last frame. Counters that wrap
+ * in the file are searched from the first frame on.
+ */
+void seek_frame(struct ingest* ingest, struct frame* frame, uint64_t number,
+    int64_t time) {
+  const struct file_index* index = &ingest->file_index;
+  struct line_reader* reader = &ingest->reader;
+  unsigned int low = 0, high = index->count;
+
+  if (index->count == 0) {
+    return;
+  }
+  if (number > index->frame_count) {
+    number = index->frame_count;
+  }
+  if (time >= 0 && !index->ordered) {
+    high = 1;
+  }
+
+  // the last entry at or before the frame
+  while (high - low > 1) {
+    unsigned int middle = low + (high - low) / 2;
+
+    if (time >= 0 ? index->entries[middle].time <= time
+        : index->entries[middle].frame <= number) {
+      low = middle;
+    } else {
+      high = middle;
+    }
+  }
+  set_reader_position(reader, index->entries[low].offset);
+  ingest->frame_number = index->entries[low].frame - 1;
+
+  while (time >= 0 || ingest->frame_number + 1 < number) {
+    uint64_t position = reader_position(reader);
+
+    if (read_indexed_frame(reader, frame) == READ_EOF) {
+      seek_frame(ingest, frame, index->frame_count, -1);
+      return;
+    }
+    if (time >= 0 && counter_time(frame) >= time) {
+      set_reader_position(reader, position);
+      return;
+    }
+    ingest->frame_number++;
+  }
+}
+
+// waits on the last frame of a file that was jumped in for the next jump
+void wait_for_jump(struct ingest* ingest) {
+  while (atomic_load_explicit(&ingest->jump, memory_order_relaxed)
+      == JUMP_NONE) {
+    usleep(REFRESH_INTERVAL);
+  }
+}
+
+void watch_file(struct line_reader* reader) {
+  if (reader->inotify_fd == -1) {
+    return;
+  }
+
+  if (reader->watch != -1) {
+    inotify_rm_watch(reader->inotify_fd, reader->watch);
+  }
+  reader->watch = inotify_add_watch(reader->inotify_fd, reader->path,
+      IN_MODIFY | IN_ATTRIB | IN_MOVE_SELF | IN_DELETE_SELF);
+}
+
+/*
+ * Opens the output file for appending. A binary file that already has frames
+ * keeps its layout, new frames are stored in it.
+ */
+void open_log(struct log_ring* log, char* file_name) {
+  log->fd = open(file_name, O_RDWR | O_CREAT | O_APPEND, 0666);
+  if (log->fd == -1) {
+    finish_screen(0);
+    perror("Failed to open file");
+    exit(EXIT_FAILURE);
+  }
+
+  log->format = OUTPUT_FORMAT;
+  log->record = NULL;
+  log->record_size = 0;
+  log->header_size = 0;
+  log->layout.counts = NULL;
+  log->has_layout = false;
+
+  struct stat st;
+  if (log->format == OUTPUT_BINARY && fstat(log->fd, &st) == 0
+      && st.st_size > 0) {
+    if (!read_capture_header(log->fd, &log->layout)) {
+      finish_screen(0);
+      fprintf(stderr, "%s is not a binary capture file\n", file_name);
+      exit(EXIT_FAILURE);
+    }
+    log->has_layout = true;
+    log->record_size = capture_record_size(&log->layout);
+    log->record = malloc(log->record_size);
+  }
+
+  if (posix_memalign((void**) &log->buffer, LOG_BUFFER_ALIGNMENT,
+      LOG_RING_SIZE) != 0) {
+    finish_screen(0);
+    fprintf(stderr, "Failed to allocate log buffer\n");
+    exit(EXIT_FAILURE);
+  }
+
+  atomic_init(&log->head, 0);
+  atomic_init(&log->tail, 0);
+  atomic_init(&log->finished, false);
+  atomic_init(&log->bytes_written, 0);
+  atomic_init(&log->records_written, 0);
+  atomic_init(&log->records_dropped, 0);
+}
+
+/*
+ * Queues the frame for the log thread in the output format. The text of the
+ * frame is the line it was parsed from.
+ */
+void log_frame(struct log_ring* log, const char* line,
+    const struct frame* frame) {
+  if (log->format == OUTPUT_TEXT) {
+    log_line(log, line);
+    return;
+  }
+
+  if (!log->has_layout) {
+    layout_from_frame(&log->layout, frame);
+    log->record_size = capture_record_size(&log->layout);
+    log->record = malloc(log->record_size > capture_header_size(&log->layout)
+        ? log->record_size : capture_header_size(&log->layout));
+    if (log->record == NULL) {
+      finish_screen(0);
+      perror("Failed to allocate log buffer");
+      exit(EXIT_FAILURE);
+    }
+
+    // the header goes first, the ring has room for it
+    log->header_size = encode_capture_header(&log->layout, log->record);
+    log_bytes(log, log->record, log->header_size);
+    log->has_layout = true;
+  }
+
+  if (!log_room(log, log->record_size)) {
+    return;
+  }
+  encode_capture_frame(&log->layout, frame, log->record);
+  log_bytes(log, log->record, log->record_size);
+}
+
+/*
+ * Queues the line, with a newline unless it already ends with one. Returns
+ * false if it was dropped.
+ */
+bool log_line(struct log_ring* log, const char* line) {
+  size_t length = strlen(line);
+
+  if (length > LOG_RING_SIZE - 1) {
+    length = LOG_RING_SIZE - 1;
+  }
+  bool newline = (length == 0 || line[length - 1] != '\n');
+
+  if (!log_room(log, length + newline)) {
+    return false;
+  }
+  log_bytes(log, line, length);
+  if (newline) {
+    log_bytes(log, "\n", 1);
+  }
+  return true;
+}
+
+/*
+ * Returns true if a record of length bytes fits in the ring. Otherwise the
+ * record is counted as dropped, as the disk has fallen a whole ring behind.
+ */
+bool log_room(struct log_ring* log, size_t length) {
+  size_t head = atomic_load_explicit(&log->head, memory_order_relaxed);
+
+  if (head + length - atomic_load_explicit(&log->tail, memory_order_acquire)
+      > LOG_RING_SIZE) {
+    atomic_fetch_add_explicit(&log->records_dropped, 1,
+        memory_order_relaxed);
+    return false;
+  }
+  return true;
+}
+
+// queues bytes that log_room() found room for
+void log_bytes(struct log_ring* log, const void* data, size_t length) {
+  size_t head = atomic_load_explicit(&log->head, memory_order_relaxed);
+  size_t start = head % LOG_RING_SIZE;
+  size_t first = LOG_RING_SIZE - start;
+  if (first >= length) {
+    memcpy(log->buffer + start, data, length);
+  } else {
+    memcpy(log->buffer + start, data, first);
+    memcpy(log->buffer, (const char*) data + first, length - first);
+  }
+
+  atomic_store_explicit(&log->head, head + length, memory_order_release);
+}
+
+// log thread, writes queued lines until the reader has finished
+void* write_log(void* arg) {
+  struct log_ring* log = arg;
+  long long last_sync = monotonic_ms();
+  bool unsynced = false;
+
+  for (;;) {
+    bool finished = atomic_load_explicit(&log->finished, memory_order_acquire);
+    size_t head = atomic_load_explicit(&log->head, memory_order_acquire);
+    size_t tail = atomic_load_explicit(&log->tail, memory_order_relaxed);
+
+    if (unsynced && FSYNC_POLICY == FSYNC_INTERVAL && monotonic_ms()
+        - last_sync >= FSYNC_INTERVAL_MS) {
+      sync_log(log);
+      last_sync = monotonic_ms();
+      unsynced = false;
+    }
+
+    if (head == tail) {
+      if (finished) {
+        break;
+      }
+      wait_for_log(log, tail);
+      continue;
+    }
+
+    // the queued bytes, in two parts if they wrap around the ring
+    struct iovec parts[2];
+    int part_count = 1;
+    size_t start = tail % LOG_RING_SIZE;
+    size_t length = head - tail;
+
+    parts[0].iov_base = log->buffer + start;
+    parts[0].iov_len = length;
+    if (length > LOG_RING_SIZE - start) {
+      parts[0].iov_len = LOG_RING_SIZE - start;
+      parts[1].iov_base = log->buffer;
+      parts[1].iov_len = length - parts[0].iov_len;
+      part_count = 2;
+    }
+
+    ssize_t n = writev(log->fd, parts, part_count);
+    if (n == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      finish_screen(0);
+      perror("Failed to write to file");
+      exit(EXIT_FAILURE);
+    }
+
+    unsigned long records = 0;
+    if (log->record_size == 0) {
+      size_t i;
+      for (i = 0; i < n; i++) {
+        if (log->buffer[(tail + i) % LOG_RING_SIZE] == '\n') {
+          records++;
+        }
+      }
+    } else if (tail + n > log->header_size) {
+      // the header is queued before any frame, right at the start
+      size_t from = tail > log->header_size ? tail - log->header_size : 0;
+      records = (tail + n - log->header_size) / log->record_size - from
+          / log->record_size;
+    }
+    atomic_fetch_add_explicit(&log->bytes_written, n, memory_order_relaxed);
+    atomic_fetch_add_explicit(&log->records_written, records,
+        memory_order_relaxed);
+    atomic_store_explicit(&log->tail, tail + n, memory_order_release);
+
+    if (FSYNC_POLICY == FSYNC_EVERY) {
+      sync_log(log);
+    } else {
+      unsynced = true;
+    }
+  }
+
+  if (unsynced && FSYNC_POLICY != FSYNC_NEVER) {
+    sync_log(log);
+  }
+
+  return NULL;
+}
+
+/*
+ * Lets lines pile up for LOG_BATCH_INTERVAL, or until they fill half of the
+ * ring, so that a fast reader does not lose records while the thread sleeps.
+ */
+void wait_for_log(struct log_ring* log, size_t tail) {
+  unsigned int waited;
+
+  for (waited = 0; waited < LOG_BATCH_INTERVAL; waited += LOG_POLL_INTERVAL) {
+    usleep(LOG_POLL_INTERVAL);
+    if (atomic_load_explicit(&log->head, memory_order_acquire) - tail
+        >= LOG_RING_SIZE / 2) {
+      return;
+    }
+  }
+}
+
+void sync_log(struct log_ring* log) {
+  if (fdatasync(log->fd) == -1 && errno != EINVAL) {
+    finish_screen(0);
+    perror("Failed to flush file");
+    exit(EXIT_FAILURE);
+  }
+}
+
+/*
+ * Sets up publishing to udp:HOST:PORT, which may be a multicast group, or to
+ * a collector at tcp:HOST:PORT. The collector has to be there at the start,
+ * later it is reconnected to whenever it goes away.
+ */
+void open_network_output(struct network_output* output, char* spec) {
+  output->spec = spec;
+  output->datagrams = (strncmp(spec, "udp:", 4) == 0);
+  output->frame = NULL;
+  output->frame_size = 0;
+  output->frame_end = 0;
+
+  if (!output->datagrams && strncmp(spec, "tcp:", 4) != 0) {
+    finish_screen(0);
+    fprintf(stderr, "Failed to publish to %s: use udp:HOST:PORT or "
+        "tcp:HOST:PORT\n", spec);
+    exit(EXIT_FAILURE);
+  }
+
+  output->fd = connect_network_output(output);
+  if (output->fd == -1) {
+    finish_screen(0);
+    fprintf(stderr, "Failed to publish to %s: %s\n", spec, strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+
+  output->buffer = malloc(NETWORK_RING_SIZE);
+  if (output->buffer == NULL) {
+    finish_screen(0);
+    perror("Failed to allocate network buffer");
+    exit(EXIT_FAILURE);
+  }
+
+  atomic_init(&output->head, 0);
+  atomic_init(&output->tail, 0);
+  atomic_init(&output->finished, false);
+  atomic_init(&output->frames_sent, 0);
+  atomic_init(&output->bytes_sent, 0);
+  atomic_init(&output->frames_dropped, 0);
+}
+
+/*
+ * Returns a socket connected to the host and port of the spec, or -1 with
+ * errno set. A UDP socket is connected too, so that frames are sent without
+ * addresses.
+ */
+int connect_network_output(const struct network_output* output) {
+  struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype =
+      output->datagrams ? SOCK_DGRAM : SOCK_STREAM };
+  struct addrinfo* addresses;
+  struct addrinfo* address;
+  char host[256];
+  const char* port = strrchr(output->spec + 4, ':');
+  int fd = -1;
+
+  if (port == NULL || port - (output->spec + 4) >= (int) sizeof(host)) {
+    errno = EINVAL;
+    return -1;
+  }
+  memcpy(host, output->spec + 4, port - (output->spec + 4));
+  host[port - (output->spec + 4)] = '\0';
+
+  if (getaddrinfo(host, port + 1, &hints, &addresses) != 0) {
+    errno = EHOSTUNREACH;
+    return -1;
+  }
+  for (address = addresses; address != NULL; address = address->ai_next) {
+    fd = socket(address->ai_family, address->ai_socktype | SOCK_CLOEXEC,
+        address->ai_protocol);
+    if (fd != -1 && connect(fd, address->ai_addr, address->ai_addrlen) == 0) {
+      break;
+    }
+    if (fd != -1) {
+      close(fd);
+      fd = -1;
+    }
+  }
+  freeaddrinfo(addresses);
+
+  return fd;
+}
+
+// stores the frame as it is published, after its u32 length
+size_t encode_network_frame(const struct frame* frame, unsigned int source,
+    uint32_t sequence, unsigned char* out) {
+  unsigned char* start = out;
+  unsigned int pack, count, i;
+  int tag;
+
+  out += NETWORK_LENGTH_SIZE;
+  memcpy(out, NETWORK_MAGIC, 4);
+  put_u16(out + 4, NETWORK_VERSION);
+  put_u16(out + 6, source);
+  for (i = 0; i < 4; i++) {
+    out[8 + i] = (sequence >> (8 * i)) & 0xFF;
+  }
+  for (i = 0; i < 8; i++) {
+    out[12 + i] = ((uint64_t) frame->timestamp >> (8 * i)) & 0xFF;
+  }
+  put_u16(out + 20, frame->pack_count);
+  out += NETWORK_HEADER_SIZE;
+
+  for (pack = 0; pack < frame->pack_count; pack++) {
+    for (tag = SECTION_B; tag < SECTION_T; tag++) {
+      put_u16(out, frame->packs[pack].count[tag]);
+      out += 2;
+    }
+  }
+  put_u16(out, frame->sections[SECTION_T].count);
+  out += 2;
+
+  for (pack = 0; pack < frame->pack_count; pack++) {
+    for (tag = SECTION_B; tag < SECTION_T; tag++) {
+      const int* values = pack_values(frame, pack, tag, &count);
+      for (i = 0; i < count; i++) {
+        put_u16(out, values[i]);
+        out += 2;
+      }
+    }
+  }
+  const int* values = pack_values(frame, 0, SECTION_T, &count);
+  for (i = 0; i < count; i++) {
+    put_u16(out, values[i]);
+    out += 2;
+  }
+
+  size_t length = out - start - NETWORK_LENGTH_SIZE;
+  for (i = 0; i < NETWORK_LENGTH_SIZE; i++) {
+    start[i] = (length >> (8 * i)) & 0xFF;
+  }
+  return out - start;
+}
+
+// queues the frame for the network thread, or drops it if the ring is full
+void queue_network_frame(struct network_output* output,
+    const struct frame* frame, unsigned int source, uint32_t sequence) {
+  size_t size = NETWORK_LENGTH_SIZE + NETWORK_HEADER_SIZE
+      + 2 * (SECTION_T * frame->pack_count + 1)
+      + 2 * (frame->sections[SECTION_B].count + frame->sections[SECTION_H].count
+      + frame->sections[SECTION_E].count + frame->sections[SECTION_P].count
+      + frame->sections[SECTION_T].count);
+
+  if (size > output->frame_size) {
+    unsigned char* buffer = realloc(output->frame, size);
+    if (buffer == NULL) {
+      finish_screen(0);
+      perror("Failed to allocate network buffer");
+      exit(EXIT_FAILURE);
+    }
+    output->frame = buffer;
+    output->frame_size = size;
+  }
+  size = encode_network_frame(frame, source, sequence, output->frame);
+
+  size_t head = atomic_load_explicit(&output->head, memory_order_relaxed);
+  if (head + size - atomic_load_explicit(&output->tail, memory_order_acquire)
+      > NETWORK_RING_SIZE) {
+    atomic_fetch_add_explicit(&output->frames_dropped, 1,
+        memory_order_relaxed);
+    return;
+  }
+
+  size_t start = head % NETWORK_RING_SIZE;
+  size_t first = NETWORK_RING_SIZE - start;
+  if (first >= size) {
+    memcpy(output->buffer + start, output->frame, size);
+  } else {
+    memcpy(output->buffer + start, output->frame, first);
+    memcpy(output->buffer, output->frame + first, size - first);
+  }
+
+  atomic_store_explicit(&output->head, head + size, memory_order_release);
+}
+
+/*
+ * Network thread, sends the queued frames until the reader has finished:
+ * up to NETWORK_BATCH datagrams with one sendmmsg(), or everything that is
+ * queued with one sendmsg() on TCP.
+ */
+void* send_network_frames(void* arg) {
+  struct network_output* output = arg;
+  long long last_attempt = 0;
+
+  for (;;) {
+    bool finished = atomic_load_explicit(&output->finished,
+        memory_order_acquire);
+    size_t head = atomic_load_explicit(&output->head, memory_order_acquire);
+    size_t tail = atomic_load_explicit(&output->tail, memory_order_relaxed);
+
+    if (head == tail) {
+      if (finished) {
+        break;
+      }
+      usleep(NETWORK_BATCH_INTERVAL);
+      continue;
+    }
+
+    if (output->fd == -1) {
+      // frames for a collector that is away are dropped, not sent late
+      if (monotonic_ms() - last_attempt >= NETWORK_RECONNECT_INTERVAL) {
+        last_attempt = monotonic_ms();
+        output->fd = connect_network_output(output);
+      }
+      if (output->fd == -1) {
+        size_t dropped = 0;
+        while (tail + dropped < head) {
+          dropped += NETWORK_LENGTH_SIZE + get_u32_at(output->buffer,
+              NETWORK_RING_SIZE, tail + dropped);
+          atomic_fetch_add_explicit(&output->frames_dropped, 1,
+              memory_order_relaxed);
+        }
+        atomic_store_explicit(&output->tail, head, memory_order_release);
+        if (finished) {
+          break;
+        }
+        usleep(NETWORK_BATCH_INTERVAL);
+        continue;
+      }
+    }
+
+    if (output->datagrams) {
+      tail += send_datagrams(output, tail, head);
+    } else {
+      ssize_t n = send_stream(output, tail, head);
+      if (n == -1) {
+        // connect again right away, then every NETWORK_RECONNECT_INTERVAL
+        close(output->fd);
+        output->fd = -1;
+        last_attempt = 0;
+
+        // a new connection starts with a whole frame
+        if (output->frame_end > tail) {
+          atomic_fetch_add_explicit(&output->frames_dropped, 1,
+              memory_order_relaxed);
+          atomic_store_explicit(&output->tail, output->frame_end,
+              memory_order_release);
+        }
+        continue;
+      }
+      tail += n;
+    }
+    atomic_store_explicit(&output->tail, tail, memory_order_release);
+  }
+
+  return NULL;
+}
+
+/*
+ * Sends the frames queued from tail to head as datagrams, each without its
+ * length. A datagram that cannot be sent is dropped. Returns the bytes of the
+ * ring that are done with.
+ */
+size_t send_datagrams(struct network_output* output, size_t tail,
+    size_t head) {
+  struct mmsghdr messages[NETWORK_BATCH];
+  struct iovec parts[NETWORK_BATCH][2];
+  size_t offset = tail;
+  unsigned int count = 0;
+
+  while (offset < head && count < NETWORK_BATCH) {
+    size_t length = get_u32_at(output->buffer, NETWORK_RING_SIZE, offset);
+    size_t start = (offset + NETWORK_LENGTH_SIZE) % NETWORK_RING_SIZE;
+    struct msghdr* message = &messages[count].msg_hdr;
+
+    memset(message, 0, sizeof(*message));
+    message->msg_iov = parts[count];
+    message->msg_iovlen = 1;
+    parts[count][0].iov_base = output->buffer + start;
+    parts[count][0].iov_len = length;
+    if (length > NETWORK_RING_SIZE - start) {
+      parts[count][0].iov_len = NETWORK_RING_SIZE - start;
+      parts[count][1].iov_base = output->buffer;
+      parts[count][1].iov_len = length - parts[count][0].iov_len;
+      message->msg_iovlen = 2;
+    }
+
+    offset += NETWORK_LENGTH_SIZE + length;
+    count++;
+  }
+
+  unsigned int sent = 0;
+  while (sent < count) {
+    int n = sendmmsg(output->fd, messages + sent, count - sent, 0);
+    if (n == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      // the rest of the batch is lost, like datagrams on the way are
+      atomic_fetch_add_explicit(&output->frames_dropped, count - sent,
+          memory_order_relaxed);
+      break;
+    }
+
+    int i;
+    for (i = 0; i < n; i++) {
+      atomic_fetch_add_explicit(&output->bytes_sent,
+          messages[sent + i].msg_len, memory_order_relaxed);
+    }
+    atomic_fetch_add_explicit(&output->frames_sent, n, memory_order_relaxed);
+    sent += n;
+  }
+
+  return offset - tail;
+}
+
+/*
+ * Sends the frames queued from tail to head on the TCP stream. Returns the
+ * bytes sent, or -1 if the collector has gone away.
+ */
+ssize_t send_stream(struct network_output* output, size_t tail, size_t head) {
+  struct iovec parts[2];
+  struct msghdr message = { .msg_iov = parts, .msg_iovlen = 1 };
+  size_t start = tail % NETWORK_RING_SIZE;
+  size_t length = head - tail;
+  ssize_t n;
+
+  parts[0].iov_base = output->buffer + start;
+  parts[0].iov_len = length;
+  if (length > NETWORK_RING_SIZE - start) {
+    parts[0].iov_len = NETWORK_RING_SIZE - start;
+    parts[1].iov_base = output->buffer;
+    parts[1].iov_len = length - parts[0].iov_len;
+    message.msg_iovlen = 2;
+  }
+
+  do {
+    n = sendmsg(output->fd, &message, MSG_NOSIGNAL);
+  } while (n == -1 && errno == EINTR);
+  if (n == -1) {
+    return -1;
+  }
+
+  // count the frames that are now sent whole, their lengths are read before
+  // the bytes are given back to the reader
+  unsigned long frames = 0;
+  if (output->frame_end <= tail) {
+    output->frame_end = tail + NETWORK_LENGTH_SIZE
+        + get_u32_at(output->buffer, NETWORK_RING_SIZE, tail);
+  }
+  while (output->frame_end <= tail + n) {
+    frames++;
+    if (output->frame_end >= head) {
+      break;
+    }
+    output->frame_end += NETWORK_LENGTH_SIZE + get_u32_at(output->buffer,
+        NETWORK_RING_SIZE, output->frame_end);
+  }
+  atomic_fetch_add_explicit(&output->frames_sent, frames,
+      memory_order_relaxed);
+  atomic_fetch_add_explicit(&output->bytes_sent, n, memory_order_relaxed);
+  return n;
+}
+
+// reads a u32 from the ring, which it may wrap around
+uint32_t get_u32_at(const unsigned char* ring, size_t size, size_t offset) {
+  uint32_t value = 0;
+  unsigned int i;
+
+  for (i = 0; i < 4; i++) {
+    value |= (uint32_t) ring[(offset + i) % size] << (8 * i);
+  }
+  return value;
+}
+
+long long monotonic_ms() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000LL + now.tv_nsec / 1000000;
+}
+
+long long monotonic_us() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000000LL + now.tv_nsec / 1000;
+}
+
+long long monotonic_ns() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+// time of the frame in the input for PACE, in microseconds
+int64_t frame_input_time(const struct frame* frame) {
+  if (PACE == PACE_TIMESTAMPS) {
+    return frame->timestamp;
+  }
+  return counter_time(frame);
+}
+
+// time of the seconds, minutes and hours counters, in microseconds
+int64_t counter_time(const struct frame* frame) {
+  const struct section* counters = &frame->sections[SECTION_T];
+  int64_t seconds = 0;
+  int64_t unit = 1;
+  unsigned int i;
+
+  for (i = 0; i < counters->count && i < 3; i++) {
+    seconds += counters->values[i] * unit;
+    unit *= 60;
+  }
+  return seconds * 1000000;
+}
+
+/*
+ * Sets when the frame is due: SPEED times faster than it came after the last
+ * frame in the input. Due times are kept on the monotonic clock, so the time
+ * spent parsing and drawing does not add up. A reader that is more than
+ * PACE_MAX_LAG behind does not try to catch up, it takes the current time as
+ * the new schedule and the screen skips the frames in between. Returns true
+ * if the frame has to wait until pacer->due.
+ */
+bool schedule_frame(struct pacer* pacer, const struct frame* frame) {
+  long long now = monotonic_us();
+  int64_t input_time = 0;
+  int64_t gap = 0;
+
+  if (PACE == PACE_INTERVAL) {
+    gap = FRAME_INTERVAL;
+  } else {
+    input_time = frame_input_time(frame);
+    gap = input_time - pacer->input_time;
+
+    // the counters wrap around after a minute, or an hour with minutes
+    if (gap < 0 && PACE == PACE_COUNTERS
+        && frame->sections[SECTION_T].count < 3) {
+      gap += (frame->sections[SECTION_T].count < 2 ? 60 : 3600) * 1000000LL;
+    }
+    if (gap < 0) {
+      gap = 0;
+    }
+    if (gap > PACE_MAX_GAP) {
+      gap = PACE_MAX_GAP;
+    }
+  }
+  pacer->input_time = input_time;
+
+  if (!pacer->started || SPEED == 0) {
+    pacer->started = true;
+    pacer->due = now;
+    return false;
+  }
+
+  pacer->due += (long long) (gap / SPEED);
+  if (now - pacer->due > PACE_MAX_LAG) {
+    pacer->due = now;
+    return false;
+  }
+  return pacer->due > now;
+}
+
+// waits until the frame is due, see schedule_frame()
+void pace_frame(struct pacer* pacer, const struct frame* frame) {
+  if (!schedule_frame(pacer, frame)) {
+    return;
+  }
+
+  struct timespec due = { .tv_sec = pacer->due / 1000000, .tv_nsec =
+      (pacer->due % 1000000) * 1000 };
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &due, NULL) == EINTR) {
+  }
+}
+
+/*
+ * Allocates count frames for the input, from the layout of a capture file or
+ * from the first valid line, which read_frame() then returns again. Returns
+ * false if the input ends before a valid line.
+ */
+bool alloc_input_frames(struct ingest* ingest, struct frame* frames,
+    unsigned int count) {
+  struct line_reader* reader = &ingest->reader;
+
+  if (reader->binary) {
+    struct capture_layout* layout = &reader->layout;
+
+    alloc_frames(frames, count, layout->pack_count, layout_max_count(layout));
+    if (ingest->keep_text) {
+      reserve_text(ingest, max_frame_line_length(layout->pack_count,
+          layout_max_count(layout)));
+    }
+    return true;
+  }
+
+  for (;;) {
+    const char* begin;
+    const char* end = NULL;
+    char* line;
+    int status;
+
+    if (reader->map != NULL) {
+      status = read_mapped_line(reader, &begin, &end);
+    } else {
+      status = read_line(reader, &line);
+      begin = line;
+    }
+
+    if (status == READ_EOF) {
+      if (!reader->follow || ingest->multiplexed) {
+        return false;
+      }
+      wait_for_data(reader);
+      continue;
+    }
+
+    if (alloc_frames_for_line(frames, count, begin, end)) {
+      if (reader->map != NULL) {
+        reader->map_offset = begin - reader->map;
+      } else {
+        reader->repeat_line = line;
+      }
+      return true;
+    }
+  }
+}
+
+/*
+ * Reads the next valid frame, skipping invalid lines. If the ingest keeps
+ * text, text is set to the text of the frame for the log, otherwise to NULL.
+ * Returns READ_EOF if no complete frame is left.
+ */
+int read_frame(struct ingest* ingest, struct frame* frame, char** text) {
+  struct line_reader* reader = &ingest->reader;
+
+  *text = NULL;
+  if (atomic_load_explicit(&ingest->jump, memory_order_relaxed)
+      != JUMP_NONE) {
+    jump(ingest, frame);
+  }
+
+  if (reader->binary) {
+    long long start = monotonic_ns();
+    if (read_capture_frame(reader, frame) == READ_EOF) {
+      return READ_EOF;
+    }
+    count_line(true, start);
+    if (ingest->keep_text) {
+      format_frame_line(frame, ingest->text);
+      *text = ingest->text;
+    }
+    frame->number = ++ingest->frame_number;
+    return READ_LINE;
+  }
+
+  for (;;) {
+    if (reader->map != NULL) {
+      const char* begin;
+      const char* end;
+
+      if (read_mapped_line(reader, &begin, &end) == READ_EOF) {
+        return READ_EOF;
+      }
+
+      // a mapped line is read only, its text goes elsewhere
+      char* out = NULL;
+      if (ingest->keep_text) {
+        out = reserve_text(ingest, end - begin + 1);
+      }
+      long long start = monotonic_ns();
+      bool valid = parse_frame_range(begin, end, out, frame,
+          previous_frame(ingest, frame));
+      count_line(valid, start);
+      count_parse_errors(frame);
+      if (!valid) {
+        continue;
+      }
+      *text = out;
+    } else {
+      char* line;
+
+      if (read_line(reader, &line) == READ_EOF) {
+        return READ_EOF;
+      }
+      long long start = monotonic_ns();
+      bool valid = parse_frame(line, frame, previous_frame(ingest, frame));
+      count_line(valid, start);
+      count_parse_errors(frame);
+      if (!valid) {
+        continue;
+      }
+      if (ingest->keep_text) {
+        *text = line;
+      }
+    }
+
+    copy_frame(&ingest->previous, frame);
+    frame->timestamp = realtime_us();
+    frame->number = ++ingest->frame_number;
+    return READ_LINE;
+  }
+}
+
+/*
+ * The last frame the ingest parsed, to repair the next one from, or NULL
+ * before the first one. It is allocated like the frame on the first call.
+ */
+const struct frame* previous_frame(struct ingest* ingest,
+    const struct frame* frame) {
+  struct frame* previous = &ingest->previous;
+
+  if (previous->packs == NULL) {
+    alloc_frame(previous, frame->pack_capacity, frame->value_capacity);
+    return NULL;
+  }
+  return (ingest->frame_number > 0) ? previous : NULL;
+}
+
+// reader thread, reads frames into the frame ring until the input ends
+void* read_frames(void* arg) {
+  struct ingest* ingest = arg;
+  struct frame_ring* ring = ingest->frames;
+  char* text;
+
+  if (alloc_input_frames(ingest, ring->frames, FRAME_RING_SIZE + 2)) {
+    init_alarms(&ingest->alarms, ring->frames[0].sections[SECTION_B].capacity);
+    init_history(&ingest->history,
+        ring->frames[0].sections[SECTION_B].capacity);
+    init_cell_stats(&ingest->cell_stats,
+        ring->frames[0].sections[SECTION_B].capacity);
+    atomic_store_explicit(&ring->ready, true, memory_order_release);
+
+    for (;;) {
+      struct frame* frame = next_free_frame(ring);
+
+      if (read_frame(ingest, frame, &text) == READ_EOF) {
+        if (ring->pending != NULL) {
+          publish_spare_frame(ring);
+        }
+        if (ingest->jumped) {
+          // stays on the last frame until the next jump
+          wait_for_jump(ingest);
+          continue;
+        }
+        if (!ingest->reader.follow) {
+          break;
+        }
+        wait_for_data(&ingest->reader);
+        // new data is live, there is nothing to replay it after
+        ingest->pacer.started = false;
+        continue;
+      }
+
+      add_stat(&stats.frames_read, 1);
+      if (PACE != PACE_NONE) {
+        pace_frame(&ingest->pacer, frame);
+      }
+
+      deliver_frame(ingest, frame, text);
+
+      if (ingest->alarms.critical && ALARM_EXIT_STATUS != 0) {
+        break;
+      }
+    }
+  }
+
+  atomic_store_explicit(&ring->finished, true, memory_order_release);
+  if (ingest->log != NULL) {
+    atomic_store_explicit(&ingest->log->finished, true, memory_order_release);
+  }
+
+  return NULL;
+}
+
+/*
+ * Logs the frame, checks its alarms, adds it to the history and the cell
+ * stats, publishes it on the network and passes it to the screen.
+ */
+void deliver_frame(struct ingest* ingest, struct frame* frame, char* text) {
+  if (ingest->log != NULL) {
+    log_frame(ingest->log, text, frame);
+  }
+
+  check_alarms(&ingest->alarms, frame);
+  update_history(&ingest->history, frame);
+  update_cell_stats(&ingest->cell_stats, frame);
+  if (ingest->network != NULL) {
+    queue_network_frame(ingest->network, frame, ingest->index,
+        ++ingest->sequence);
+  }
+  publish_frame(ingest->frames, frame);
+}
+
+/*
+ * Reads what a source has without blocking, up to SOURCE_BATCH frames so that
+ * a busy source does not hold up the others. A paced frame that is not due
+ * yet is held until it is. Returns the monotonic time, in microseconds, to
+ * read the source again, or LLONG_MAX when it waits for more input.
+ */
+long long read_source(struct ingest* ingest) {
+  struct frame_ring* ring = ingest->frames;
+  unsigned int i;
+  char* text;
+
+  if (!atomic_load_explicit(&ring->ready, memory_order_relaxed)) {
+    if (!alloc_input_frames(ingest, ring->frames, FRAME_RING_SIZE + 2)) {
+      if (!ingest->reader.follow) {
+        finish_source(ingest);
+      }
+      return LLONG_MAX;
+    }
+    init_alarms(&ingest->alarms, ring->frames[0].sections[SECTION_B].capacity);
+    init_history(&ingest->history,
+        ring->frames[0].sections[SECTION_B].capacity);
+    init_cell_stats(&ingest->cell_stats,
+        ring->frames[0].sections[SECTION_B].capacity);
+    atomic_store_explicit(&ring->ready, true, memory_order_release);
+  }
+
+  if (ingest->held != NULL) {
+    if (monotonic_us() < ingest->pacer.due) {
+      return ingest->pacer.due;
+    }
+    deliver_frame(ingest, ingest->held, NULL);
+    ingest->held = NULL;
+  }
+
+  for (i = 0; i < SOURCE_BATCH; i++) {
+    struct frame* frame = next_free_frame(ring);
+
+    if (read_frame(ingest, frame, &text) == READ_EOF) {
+      if (ring->pending != NULL) {
+        publish_spare_frame(ring);
+      }
+      if (ingest->jumped) {
+        return monotonic_us() + REFRESH_INTERVAL;
+      }
+      if (!ingest->reader.follow) {
+        finish_source(ingest);
+      }
+      ingest->pacer.started = false;
+      return LLONG_MAX;
+    }
+
+    add_stat(&stats.frames_read, 1);
+    if (PACE != PACE_NONE && schedule_frame(&ingest->pacer, frame)) {
+      ingest->held = frame;
+      return ingest->pacer.due;
+    }
+    deliver_frame(ingest, frame, text);
+  }
+
+  return 0;
+}
+
+void finish_source(struct ingest* ingest) {
+  ingest->finished = true;
+  atomic_store_explicit(&ingest->frames->finished, true, memory_order_release);
+}
+
+/*
+ * Reader thread for several sources. Every source is read in turn until it
+ * has nothing left, then the thread sleeps in epoll until one of them has
+ * more input or a paced frame is due. Followed files without inotify are
+ * checked every FOLLOW_POLL_INTERVAL.
+ */
+void* read_sources(void* arg) {
+  struct epoll_event events[SOURCE_EVENTS];
+  unsigned int left = source_count;
+  bool polled = false; // some source has no descriptor to wait on
+  bool critical = false;
+  unsigned int i;
+  int n;
+
+  int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  if (epoll_fd == -1) {
+    finish_screen(0);
+    perror("Failed to create epoll instance");
+    exit(EXIT_FAILURE);
+  }
+
+  for (i = 0; i < source_count; i++) {
+    struct line_reader* reader = &sources[i].ingest.reader;
+    struct epoll_event event = { .events = EPOLLIN, .data.ptr = reader };
+
+    if (source_fd(reader) != -1) {
+      epoll_ctl(epoll_fd, EPOLL_CTL_ADD, source_fd(reader), &event);
+    } else if (reader->follow) {
+      polled = true;
+    }
+  }
+
+  while (left > 0 && !critical) {
+    long long wake = LLONG_MAX;
+
+    left = 0;
+    for (i = 0; i < source_count; i++) {
+      struct ingest* ingest = &sources[i].ingest;
+
+      if (ingest->finished) {
+        continue;
+      }
+
+      long long next = read_source(ingest);
+      if (ingest->finished) {
+        if (source_fd(&ingest->reader) != -1) {
+          epoll_ctl(epoll_fd, EPOLL_CTL_DEL, source_fd(&ingest->reader), NULL);
+        }
+        continue;
+      }
+      if (ingest->alarms.critical && ALARM_EXIT_STATUS != 0) {
+        critical = true;
+      }
+      if (next < wake) {
+        wake = next;
+      }
+      left++;
+    }
+    if (left == 0 || critical) {
+      break;
+    }
+
+    int timeout = polled ? FOLLOW_POLL_INTERVAL : -1;
+    if (wake != LLONG_MAX) {
+      long long due = (wake - monotonic_us() + 999) / 1000;
+      if (due < 0) {
+        due = 0;
+      }
+      if (timeout == -1 || due < timeout) {
+        timeout = due;
+      }
+    }
+
+    n = epoll_wait(epoll_fd, events, SOURCE_EVENTS, timeout);
+    for (i = 0; n > 0 && i < (unsigned int) n; i++) {
+      struct line_reader* reader = events[i].data.ptr;
+      if (!reader->device) {
+        drain_events(reader);
+        check_followed_file(reader);
+      }
+    }
+    if (n == 0 && polled) {
+      for (i = 0; i < source_count; i++) {
+        struct line_reader* reader = &sources[i].ingest.reader;
+        if (reader->follow && !reader->device) {
+          check_followed_file(reader);
+        }
+      }
+    }
+  }
+
+  close(epoll_fd);
+  for (i = 0; i < source_count; i++) {
+    atomic_store_explicit(&sources[i].ingest.frames->finished, true,
+        memory_order_release);
+  }
+
+  return NULL;
+}
+
+// returns the text buffer of the reader, with room for at least size bytes
+char* reserve_text(struct ingest* ingest, size_t size) {
+  if (size > ingest->text_size) {
+    char* text = realloc(ingest->text, size);
+    if (text == NULL) {
+      finish_screen(0);
+      perror("Failed to allocate line buffer");
+      exit(EXIT_FAILURE);
+    }
+    ingest->text = text;
+    ingest->text_size = size;
+  }
+
+  return ingest->text;
+}
+
+// frame for the reader to parse into, the spare one if the ring is full
+struct frame* next_free_frame(struct frame_ring* ring) {
+  unsigned int head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+  unsigned int tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+
+  if (head - tail >= FRAME_RING_SIZE) {
+    struct frame* spare = &ring->frames[FRAME_RING_SIZE];
+    return (ring->pending == spare) ? spare + 1 : spare;
+  }
+  return &ring->frames[head % FRAME_RING_SIZE];
+}
+
+void publish_frame(struct frame_ring* ring, struct frame* frame) {
+  if (ring->pending != NULL) {
+    atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+    ring->pending = NULL;
+  }
+
+  if (frame >= &ring->frames[FRAME_RING_SIZE]) {
+    ring->pending = frame;
+    return;
+  }
+
+  unsigned int head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+  atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+/*
+ * Waits for room in the ring and swaps the spare frame into it. Frames only
+ * point to their values, so the swap copies no values.
+ */
+void publish_spare_frame(struct frame_ring* ring) {
+  struct frame* spare = ring->pending;
+
+  while (next_free_frame(ring) >= &ring->frames[FRAME_RING_SIZE]) {
+    usleep(1000);
+  }
+
+  unsigned int head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+  struct frame* slot = &ring->frames[head % FRAME_RING_SIZE];
+  struct frame frame = *slot;
+  *slot = *spare;
+  *spare = frame;
+
+  ring->pending = NULL;
+  atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+/*
+ * Returns the newest frame, or NULL if nothing has been published since the
+ * last call. The frame stays valid until release_frames() with head.
+ */
+const struct frame* newest_frame(struct frame_ring* ring, unsigned int* head) {
+  *head = atomic_load_explicit(&ring->head, memory_order_acquire);
+
+  if (*head == atomic_load_explicit(&ring->tail, memory_order_relaxed)) {
+    return NULL;
+  }
+  return &ring->frames[(*head - 1) % FRAME_RING_SIZE];
+}
+
+void release_frames(struct frame_ring* ring, unsigned int head) {
+  atomic_store_explicit(&ring->tail, head, memory_order_release);
+}
+
+void init_char_classes() {
+  const char* c;
+  int i;
+
+  memset(CHAR_CLASSES, CHAR_INVALID, sizeof(CHAR_CLASSES));
+  for (c = WHITE_SPACE_CHARS; *c != '\0'; c++) {
+    CHAR_CLASSES[(unsigned char) *c] = CHAR_SPACE;
+  }
+  for (c = ALLOWED_CHARS; *c != '\0'; c++) {
+    if (*c >= '0' && *c <= '9') {
+      CHAR_CLASSES[(unsigned char) *c] = CHAR_DIGIT;
+    } else if (*c == ',') {
+      CHAR_CLASSES[(unsigned char) *c] = CHAR_SEPARATOR;
+    } else {
+      CHAR_CLASSES[(unsigned char) *c] = CHAR_TAG;
+    }
+  }
+
+  memset(SECTION_OF_TAG, SECTION_NONE, sizeof(SECTION_OF_TAG));
+  for (i = 0; i < SECTION_TAG_COUNT; i++) {
+    SECTION_OF_TAG[SECTION_TAGS[i] - 'A'] = i;
+  }
+}
+
+/*
+ * Counts the packs of a data line and the values in its longest section,
+ * for sizing the frame. The line ends at end, or at '\0' if end is NULL.
+ * Returns false if the line is not a valid data line.
+ */
+bool measure_line(const char* begin, const char* end,
+    unsigned int* pack_count, unsigned int* value_count) {
+  const char* c;
+
+  bool token_started = false;
+  bool token_is_number = false;
+  bool has_tokens = false;
+  unsigned int values = 0;
+
+  *pack_count = 0;
+  *value_count = 0;
+
+  for (c = begin;; c++) {
+    bool line_end = (c == end || *c == '\0');
+    unsigned char char_class = line_end ? CHAR_SEPARATOR
+        : CHAR_CLASSES[(unsigned char) *c];
+
+    switch (char_class) {
+    case CHAR_INVALID:
+      return false;
+
+    case CHAR_DIGIT:
+    case CHAR_TAG:
+      if (!token_started) {
+        token_started = true;
+        has_tokens = true;
+        token_is_number = (char_class == CHAR_DIGIT);
+        if (!token_is_number) {
+          values = 0;
+          if (*c == 'B') {
+            (*pack_count)++;
+          }
+        }
+      }
+      break;
+
+    case CHAR_SEPARATOR:
+      if (token_started && token_is_number && ++values > *value_count) {
+        *value_count = values;
+      }
+      token_started = false;
+      break;
+    }
+
+    if (line_end) {
+      break;
+    }
+  }
+
+  return has_tokens;
+}
+
+/*
+ * Allocates the frames for the layout of the line, unless --max-packs and
+ * --max-cells say otherwise. Returns false if the line is not a valid data
+ * line.
+ */
+bool alloc_frames_for_line(struct frame* frames, unsigned int count,
+    const char* begin, const char* end) {
+  unsigned int pack_count, value_count;
+
+  if (!measure_line(begin, end, &pack_count, &value_count)) {
+    return false;
+  }
+
+  alloc_frames(frames, count, pack_count, value_count);
+  return true;
+}
+
+// allocates the frames for the layout, unless options say otherwise
+void alloc_frames(struct frame* frames, unsigned int count,
+    unsigned int pack_count, unsigned int value_count) {
+  unsigned int i;
+
+  if (MAX_PACKS > 0) {
+    pack_count = MAX_PACKS;
+  }
+  if (MAX_CELLS > 0) {
+    value_count = MAX_CELLS;
+  }
+
+  for (i = 0; i < count; i++) {
+    alloc_frame(&frames[i], pack_count > 0 ? pack_count : 1,
+        value_count > 0 ? value_count : 1);
+  }
+}
+
+void alloc_frame(struct frame* frame, unsigned int pack_capacity,
+    unsigned int value_capacity) {
+  size_t packs_size = pack_capacity * sizeof(struct pack);
+  size_t values_size = (SECTION_T * pack_capacity + 1) * value_capacity
+      * sizeof(int);
+  size_t stats_size = CELL_STAT_COUNT * pack_capacity * value_capacity
+      * sizeof(float);
+  size_t alarms_size = pack_capacity * value_capacity;
+  int i;
+
+  char* arena = malloc(packs_size + values_size + stats_size + alarms_size);
+  if (arena == NULL) {
+    finish_screen(0);
+    perror("Failed to allocate frame");
+    exit(EXIT_FAILURE);
+  }
+
+  frame->pack_count = 0;
+  frame->pack_capacity = pack_capacity;
+  frame->value_capacity = value_capacity;
+  frame->truncated = false;
+  memset(frame->errors, 0, sizeof(frame->errors));
+  frame->packs = (struct pack*) arena;
+
+  int* values = (int*) (arena + packs_size);
+  for (i = 0; i < SECTION_TAG_COUNT; i++) {
+    frame->sections[i].count = 0;
+    frame->sections[i].capacity = value_capacity
+        * (i == SECTION_T ? 1 : pack_capacity);
+    frame->sections[i].values = values;
+    values += frame->sections[i].capacity;
+  }
+
+  float* stats = (float*) values;
+  for (i = 0; i < CELL_STAT_COUNT; i++) {
+    frame->cell_stats[i] = stats;
+    stats += pack_capacity * value_capacity;
+  }
+  frame->alarms = (unsigned char*) stats;
+}
+
+void free_frame(struct frame* frame) {
+  free(frame->packs);
+  frame->packs = NULL;
+}
+
+/*
+ * Strips white space from the line in place and parses all sections of all
+ * packs into the frame, in one pass. Damage to the line is repaired from the
+ * previous frame if it is not NULL, see enum parse_error.
+ * Returns false if the line is empty or has nothing but damage.
+ */
+bool parse_frame(char* line, struct frame* frame,
+    const struct frame* previous) {
+  return parse_frame_range(line, NULL, line, frame, previous);
+}
+
+/*
+ * Like parse_frame(), for a line that ends at end, or at '\0' if end is NULL.
+ * The line is not changed. The line without white space and bytes outside
+ * ALLOWED_CHARS goes to out if it is not NULL, out may be the line itself.
+ */
+bool parse_frame_range(const char* begin, const char* end, char* out,
+    struct frame* frame, const struct frame* previous) {
+  const char* in;
+  size_t length = 0;
+
+  unsigned int section = SECTION_NONE;
+  unsigned int section_start = 0; // values of the section before this line's
+  unsigned int seen = 0; // sections of the last pack, a bit each
+  bool damaged = false; // the section has bad bytes
+  bool has_section = false; // the line has a B or T tag
+  bool lost_start = false; // values or tags before the first B
+  bool token_started = false;
+  bool token_is_number = false;
+  bool digits_ended = false;
+  int value = 0;
+  int i;
+
+  frame->pack_count = 0;
+  frame->truncated = false;
+  for (i = 0; i < SECTION_TAG_COUNT; i++) {
+    frame->sections[i].count = 0;
+  }
+  memset(frame->errors, 0, sizeof(frame->errors));
+
+  for (in = begin;; in++) {
+    unsigned char c = (in == end) ? '\0' : *in;
+    unsigned char char_class = (c == '\0') ? CHAR_SEPARATOR : CHAR_CLASSES[c];
+
+    if (frame->pack_count == 0 && c != 'B' && (char_class == CHAR_DIGIT
+        || char_class == CHAR_TAG)) {
+      lost_start = true;
+    }
+    switch (char_class) {
+    case CHAR_SPACE:
+      continue;
+
+    case CHAR_INVALID:
+      // a flipped bit, the values up to the next tag cannot be trusted
+      frame->errors[PARSE_BAD_BYTE]++;
+      damaged = true;
+      continue;
+
+    case CHAR_DIGIT:
+      if (!token_started) {
+        token_started = true;
+        token_is_number = true;
+      }
+      if (token_is_number && !digits_ended && value < 100000000) {
+        value = 10 * value + (c - '0');
+      }
+      break;
+
+    case CHAR_TAG:
+      if (!token_started) {
+        token_started = true;
+        token_is_number = false;
+        if (damaged) {
+          repair_section(frame, previous, section, section_start);
+          damaged = false;
+        }
+        section = (c >= 'A' && c <= 'Z') ? SECTION_OF_TAG[c - 'A']
+            : SECTION_NONE;
+
+        if (section < SECTION_T && section != SECTION_B
+            && (seen & (1 << section))) {
+          // the line has the sections of a pack again, its B was lost, and
+          // repair_lost_tags() gives it its values
+          frame->errors[PARSE_LOST_TAG]++;
+          if (start_pack(frame) && previous == NULL) {
+            frame->errors[PARSE_DROPPED]++;
+          }
+          seen = 1 << SECTION_B;
+        }
+
+        if (section == SECTION_B) {
+          if (!start_pack(frame)) {
+            section = SECTION_NONE;
+          }
+          seen = 0;
+        } else if (section != SECTION_T && frame->pack_count == 0) {
+          // pack sections before the first B belong to no pack
+          section = SECTION_NONE;
+        }
+        if (section != SECTION_NONE) {
+          has_section = true;
+          seen |= 1 << section;
+          section_start = frame->sections[section].count;
+        }
+      }
+      digits_ended = true;
+      break;
+
+    case CHAR_SEPARATOR:
+      if (token_started && token_is_number && section != SECTION_NONE) {
+        struct section* values = &frame->sections[section];
+        unsigned int* pack_count = (section == SECTION_T) ? &values->count
+            : &frame->packs[frame->pack_count - 1].count[section];
+
+        if (*pack_count < frame->value_capacity) {
+          values->values[values->count] = value;
+          if (section != SECTION_T) {
+            (*pack_count)++;
+          }
+          values->count++;
+        } else {
+          frame->truncated = true;
+        }
+      }
+      token_started = false;
+      digits_ended = false;
+      value = 0;
+      break;
+    }
+
+    if (c == '\0') {
+      break;
+    }
+    if (out != NULL) {
+      out[length] = c;
+    }
+    length++;
+  }
+  if (out != NULL) {
+    out[length] = '\0';
+  }
+
+  if (previous != NULL) {
+    if (previous->sections[SECTION_T].count > 0
+        && frame->sections[SECTION_T].count == 0 && frame->pack_count > 0) {
+      // the line stopped in the section it ended in, the rest is missing
+      frame->errors[PARSE_TRUNCATED]++;
+      damaged = true;
+      complete_frame(frame, previous, section, section_start, seen);
+      damaged = false;
+    } else if (lost_start && frame->pack_count < previous->pack_count) {
+      // the line lost its start and the first packs with it
+      frame->errors[PARSE_TRUNCATED]++;
+      insert_packs(frame, previous,
+          previous->pack_count - frame->pack_count);
+    }
+  }
+  if (damaged) {
+    repair_section(frame, previous, section, section_start);
+  }
+  if (previous != NULL) {
+    repair_lost_tags(frame, previous);
+    check_cell_steps(frame, previous);
+  }
+
+  // not what was repaired, so that the index counts the same frames
+  return length > 0 && (has_section || frame->errors[PARSE_BAD_BYTE] == 0);
+}
+
+// starts a pack in the frame, returns false if the frame has no room for it
+bool start_pack(struct frame* frame) {
+  int i;
+
+  if (frame->pack_count >= frame->pack_capacity) {
+    frame->truncated = true;
+    return false;
+  }
+
+  struct pack* pack = &frame->packs[frame->pack_count++];
+  for (i = 0; i < SECTION_TAG_COUNT; i++) {
+    pack->offset[i] = frame->sections[i].count;
+    pack->count[i] = 0;
+  }
+  pack->held = 0;
+  return true;
+}
+
+/*
+ * Drops what the line gave the section of the last pack, or T, from the
+ * value start on, and takes the values of the section in the previous frame
+ * instead, as far as there is one.
+ */
+void repair_section(struct frame* frame, const struct frame* previous,
+    unsigned int section, unsigned int start) {
+  if (section == SECTION_NONE) {
+    return;
+  }
+
+  struct section* values = &frame->sections[section];
+  if (section != SECTION_T) {
+    frame->packs[frame->pack_count - 1].count[section] -= values->count
+        - start;
+  }
+  values->count = start;
+
+  if (copy_section(frame, previous, section)) {
+    frame->errors[PARSE_SALVAGED]++;
+  } else {
+    frame->errors[PARSE_DROPPED]++;
+  }
+}
+
+/*
+ * Appends the values of the section of the last pack, or T, in the previous
+ * frame to the frame. Returns false if the previous frame has none.
+ */
+bool copy_section(struct frame* frame, const struct frame* previous,
+    unsigned int section) {
+  unsigned int pack = (section == SECTION_T) ? 0 : frame->pack_count - 1;
+  unsigned int count;
+
+  if (previous == NULL || (section != SECTION_T
+      && pack >= previous->pack_count)) {
+    return false;
+  }
+  const int* from = pack_values(previous, pack, section, &count);
+  if (count == 0) {
+    return false;
+  }
+
+  struct section* values = &frame->sections[section];
+  unsigned int* pack_count = (section == SECTION_T) ? &values->count
+      : &frame->packs[pack].count[section];
+  unsigned int room = frame->value_capacity - *pack_count;
+  if (count > room) {
+    count = room;
+  }
+  memcpy(values->values + values->count, from, count * sizeof(int));
+  values->count += count;
+  if (section != SECTION_T) {
+    *pack_count += count;
+  }
+  return true;
+}
+
+/*
+ * Makes up the rest of a line that ended early from the previous frame: the
+ * section it ended in, the sections of the pack it did not get to, the
+ * packs after it and T.
+ */
+void complete_frame(struct frame* frame, const struct frame* previous,
+    unsigned int section, unsigned int start, unsigned int seen) {
+  unsigned int i;
+
+  repair_section(frame, previous, section, start);
+  for (i = SECTION_B; i < SECTION_T; i++) {
+    if (!(seen & (1 << i))) {
+      copy_section(frame, previous, i);
+    }
+  }
+  while (frame->pack_count < previous->pack_count && start_pack(frame)) {
+    for (i = SECTION_B; i < SECTION_T; i++) {
+      copy_section(frame, previous, i);
+    }
+  }
+  copy_section(frame, previous, SECTION_T);
+}
+
+/*
+ * Puts the first count packs of the previous frame in front of the packs of
+ * the frame, for a line that lost its start. Both frames have the same
+ * capacities and the frame has room for the packs.
+ */
+void insert_packs(struct frame* frame, const struct frame* previous,
+    unsigned int count) {
+  unsigned int values[SECTION_T];
+  unsigned int i, section;
+
+  for (section = SECTION_B; section < SECTION_T; section++) {
+    struct section* to = &frame->sections[section];
+    const struct pack* last = &previous->packs[count - 1];
+
+    values[section] = last->offset[section] + last->count[section];
+    memmove(to->values + values[section], to->values,
+        to->count * sizeof(int));
+    memcpy(to->values, previous->sections[section].values,
+        values[section] * sizeof(int));
+    to->count += values[section];
+  }
+
+  memmove(frame->packs + count, frame->packs,
+      frame->pack_count * sizeof(struct pack));
+  memcpy(frame->packs, previous->packs, count * sizeof(struct pack));
+  for (i = count; i < count + frame->pack_count; i++) {
+    for (section = SECTION_B; section < SECTION_T; section++) {
+      frame->packs[i].offset[section] += values[section];
+    }
+  }
+  frame->pack_count += count;
+}
+
+/*
+ * Gives the sections that lost their tag their values back. Such a section
+ * has no values where the previous frame has some, and its values went to
+ * the section before it in the line, which has more than in the previous
+ * frame. When it has just as many more they move back, otherwise that
+ * section is cut back and the lost one takes the previous frame's values.
+ */
+void repair_lost_tags(struct frame* frame, const struct frame* previous) {
+  unsigned int pack, section;
+
+  for (pack = 0; pack < frame->pack_count && pack < previous->pack_count;
+      pack++) {
+    for (section = SECTION_B; section < SECTION_T; section++) {
+      unsigned int count, last_count;
+      unsigned int before_pack = pack;
+      unsigned int before = section;
+      unsigned int before_count = 0, before_last = 0;
+
+      pack_values(frame, pack, section, &count);
+      const int* last = pack_values(previous, pack, section, &last_count);
+      if (count > 0 || last_count == 0) {
+        continue;
+      }
+      // a lost B was counted when its pack started
+      if (section != SECTION_B) {
+        frame->errors[PARSE_LOST_TAG]++;
+      }
+
+      // the section before it in the line that the previous frame has
+      while (before_last == 0 && (before_pack > 0 || before > SECTION_B)) {
+        if (before == SECTION_B) {
+          before_pack--;
+          before = SECTION_P;
+        } else {
+          before--;
+        }
+        pack_values(previous, before_pack, before, &before_last);
+      }
+      const int* values = pack_values(frame, before_pack, before,
+          &before_count);
+
+      if (before_last > 0 && before_count > before_last) {
+        if (before_count - before_last == last_count) {
+          insert_values(frame, pack, section, values + before_last,
+              last_count);
+          cut_section(frame, before_pack, before, before_last);
+          continue;
+        }
+        cut_section(frame, before_pack, before, before_last);
+      }
+      insert_values(frame, pack, section, last, last_count);
+      frame->errors[PARSE_SALVAGED]++;
+    }
+  }
+}
+
+// adds values to the end of a section of a pack, as far as there is room
+void insert_values(struct frame* frame, unsigned int pack,
+    unsigned int section, const int* from, unsigned int count) {
+  struct section* values = &frame->sections[section];
+  struct pack* target = &frame->packs[pack];
+  unsigned int end = target->offset[section] + target->count[section];
+  unsigned int i;
+
+  if (count > frame->value_capacity - target->count[section]) {
+    count = frame->value_capacity - target->count[section];
+  }
+  memmove(values->values + end + count, values->values + end,
+      (values->count - end) * sizeof(int));
+  memcpy(values->values + end, from, count * sizeof(int));
+  values->count += count;
+  target->count[section] += count;
+  for (i = pack + 1; i < frame->pack_count; i++) {
+    frame->packs[i].offset[section] += count;
+  }
+}
+
+// drops the values of a section of a pack from count on
+void cut_section(struct frame* frame, unsigned int pack,
+    unsigned int section, unsigned int count) {
+  struct section* values = &frame->sections[section];
+  struct pack* target = &frame->packs[pack];
+  unsigned int end = target->offset[section] + target->count[section];
+  unsigned int removed = target->count[section] - count;
+  unsigned int i;
+
+  memmove(values->values + end - removed, values->values + end,
+      (values->count - end) * sizeof(int));
+  values->count -= removed;
+  target->count[section] = count;
+  for (i = pack + 1; i < frame->pack_count; i++) {
+    frame->packs[i].offset[section] -= removed;
+  }
+}
+
+/*
+ * Gives the cells that moved further than MAX_CELL_STEP since the last frame
+ * their last value back, drops the cells the last frame did not have and
+ * takes the ones that the line lost from the last frame, so that they do not
+ * reach the alarms, the history and the stats. All are counted. A pack that
+ * keeps its last cells for MAX_HELD_FRAMES frames in a row takes the line's
+ * cells, the change was real or the last frame was wrong.
+ */
+void check_cell_steps(struct frame* frame, const struct frame* previous) {
+  unsigned int pack, i;
+
+  if (MAX_CELL_STEP <= 0) {
+    return;
+  }
+  for (pack = 0; pack < frame->pack_count && pack < previous->pack_count;
+      pack++) {
+    unsigned int count = frame->packs[pack].count[SECTION_B], last_count;
+    int* volts = frame->sections[SECTION_B].values
+        + frame->packs[pack].offset[SECTION_B];
+    const int* last = pack_values(previous, pack, SECTION_B, &last_count);
+    bool hold = previous->packs[pack].held < MAX_HELD_FRAMES;
+    unsigned int steps = 0;
+
+    if (count > last_count && last_count > 0) {
+      steps += count - last_count;
+      if (hold) {
+        cut_section(frame, pack, SECTION_B, last_count);
+      }
+    }
+    if (count > last_count) {
+      count = last_count;
+    }
+    for (i = 0; i < count; i++) {
+      if (abs(volts[i] - last[i]) > MAX_CELL_STEP) {
+        if (hold) {
+          volts[i] = last[i];
+        }
+        steps++;
+      }
+    }
+    if (count > 0 && count < last_count) {
+      steps += last_count - count;
+      if (hold) {
+        insert_values(frame, pack, SECTION_B, last + count,
+            last_count - count);
+      }
+    }
+    frame->packs[pack].held = (steps > 0 && hold)
+        ? previous->packs[pack].held + 1 : 0;
+    frame->errors[PARSE_OUT_OF_RANGE] += steps;
+  }
+}
+
+// copies the packs and values of a frame with the same capacities
+void copy_frame(struct frame* to, const struct frame* from) {
+  int i;
+
+  to->pack_count = from->pack_count;
+  to->truncated = from->truncated;
+  memcpy(to->packs, from->packs, from->pack_count * sizeof(struct pack));
+  for (i = 0; i < SECTION_TAG_COUNT; i++) {
+    to->sections[i].count = from->sections[i].count;
+    memcpy(to->sections[i].values, from->sections[i].values,
+        from->sections[i].count * sizeof(int));
+  }
+}
+
+/*
+ * Returns the values of the tag section of the pack and stores their number
+ * in count. The T section belongs to the whole frame, use pack 0 for it.
+ */
+const int* pack_values(const struct frame* frame, unsigned int pack,
+    enum section_tag tag, unsigned int* count) {
+  const struct section* section = &frame->sections[tag];
+
+  if (tag == SECTION_T) {
+    *count = section->count;
+    return section->values;
+  }
+
+  *count = frame->packs[pack].count[tag];
+  return section->values + frame->packs[pack].offset[tag];
+}
+
+/*
+ * Formats the frame as a data line, in the order the sections come in data
+ * lines. The line must have room for max_frame_line_length() bytes.
+ */
+size_t format_frame_line(const struct frame* frame, char* line) {
+  char* out = line;
+  unsigned int pack, count, i;
+  int tag;
+
+  for (pack = 0; pack < frame->pack_count; pack++) {
+    for (tag = SECTION_B; tag < SECTION_T; tag++) {
+      const int* values = pack_values(frame, pack, tag, &count);
+      if (tag != SECTION_B && count == 0) {
+        continue;
+      }
+
+      *out++ = SECTION_TAGS[tag];
+      *out++ = ',';
+      for (i = 0; i < count; i++) {
+        out += sprintf(out, "%d,", values[i]);
+      }
+    }
+  }
+
+  const int* values = pack_values(frame, 0, SECTION_T, &count);
+  if (count > 0) {
+    *out++ = SECTION_TAGS[SECTION_T];
+    *out++ = ',';
+    for (i = 0; i < count; i++) {
+      out += sprintf(out, "%d,", values[i]);
+    }
+  }
+  *out = '\0';
+
+  return out - line;
+}
+
+size_t max_frame_line_length(unsigned int pack_count, unsigned int value_count) {
+  // a tag and a comma per section, up to 10 digits and a comma per value
+  return (SECTION_T * pack_count + 1) * (2 + 11 * value_count) + 1;
+}
+
+int64_t realtime_us() {
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  return now.tv_sec * 1000000LL + now.tv_nsec / 1000;
+}
+
+void layout_from_frame(struct capture_layout* layout,
+    const struct frame* frame) {
+  unsigned int pack;
+  int tag;
+
+  alloc_layout(layout, frame->pack_count);
+  for (pack = 0; pack < frame->pack_count; pack++) {
+    for (tag = SECTION_B; tag < SECTION_T; tag++) {
+      layout->counts[SECTION_T * pack + tag] = frame->packs[pack].count[tag];
+    }
+  }
+  layout->counts[SECTION_T * frame->pack_count]
+      = frame->sections[SECTION_T].count;
+
+  layout->value_count = 0;
+  for (pack = 0; pack <= SECTION_T * layout->pack_count; pack++) {
+    layout->value_count += layout->counts[pack];
+  }
+}
+
+void alloc_layout(struct capture_layout* layout, unsigned int pack_count) {
+  layout->pack_count = pack_count;
+  layout->value_count = 0;
+  layout->counts = calloc(SECTION_T * pack_count + 1, sizeof(unsigned int));
+  if (layout->counts == NULL) {
+    finish_screen(0);
+    perror("Failed to allocate capture layout");
+    exit(EXIT_FAILURE);
+  }
+}
+
+void free_layout(struct capture_layout* layout) {
+  free(layout->counts);
+  layout->counts = NULL;
+}
+
+// the largest value count of a section, for sizing frames
+unsigned int layout_max_count(const struct capture_layout* layout) {
+  unsigned int max = 0;
+  unsigned int i;
+
+  for (i = 0; i <= SECTION_T * layout->pack_count; i++) {
+    if (layout->counts[i] > max) {
+      max = layout->counts[i];
+    }
+  }
+  return max;
+}
+
+size_t capture_header_size(const struct capture_layout* layout) {
+  return 8 + 2 * (SECTION_T * layout->pack_count + 1);
+}
+
+size_t capture_record_size(const struct capture_layout* layout) {
+  return 8 + 2 * layout->value_count;
+}
+
+void put_u16(unsigned char* out, unsigned int value) {
+  out[0] = value & 0xFF;
+  out[1] = (value >> 8) & 0xFF;
+}
+
+unsigned int get_u16(const unsigned char* in) {
+  return in[0] | (in[1] << 8);
+}
+
+void put_u32(unsigned char* out, uint32_t value) {
+  put_u16(out, value & 0xFFFF);
+  put_u16(out + 2, value >> 16);
+}
+
+uint32_t get_u32(const unsigned char* in) {
+  return get_u16(in) | ((uint32_t) get_u16(in + 2) << 16);
+}
+
+void put_u64(unsigned char* out, uint64_t value) {
+  unsigned int i;
+
+  for (i = 0; i < 8; i++) {
+    out[i] = (value >> (8 * i)) & 0xFF;
+  }
+}
+
+uint64_t get_u64(const unsigned char* in) {
+  uint64_t value = 0;
+  unsigned int i;
+
+  for (i = 0; i < 8; i++) {
+    value |= (uint64_t) in[i] << (8 * i);
+  }
+  return value;
+}
+
+size_t encode_capture_header(const struct capture_layout* layout,
+    unsigned char* out) {
+  unsigned int i;
+
+  memcpy(out, CAPTURE_MAGIC, 4);
+  put_u16(out + 4, CAPTURE_VERSION);
+  put_u16(out + 6, layout->pack_count);
+  for (i = 0; i <= SECTION_T * layout->pack_count; i++) {
+    put_u16(out + 8 + 2 * i, layout->counts[i]);
+  }
+
+  return capture_header_size(layout);
+}
+
+/*
+ * Reads the header at the start of the file into the layout. Returns false
+ * if the file does not start with a capture header.
+ */
+bool read_capture_header(int fd, struct capture_layout* layout) {
+  unsigned char start[8];
+  unsigned int i;
+
+  if (pread(fd, start, sizeof(start), 0) != sizeof(start)
+      || memcmp(start, CAPTURE_MAGIC, 4) != 0
+      || get_u16(start + 4) != CAPTURE_VERSION) {
+    return false;
+  }
+
+  alloc_layout(layout, get_u16(start + 6));
+  size_t counts_size = 2 * (SECTION_T * layout->pack_count + 1);
+  unsigned char* counts = malloc(counts_size);
+
+  if (counts == NULL || pread(fd, counts, counts_size, sizeof(start))
+      != counts_size) {
+    free(counts);
+    free_layout(layout);
+    return false;
+  }
+
+  for (i = 0; i <= SECTION_T * layout->pack_count; i++) {
+    layout->counts[i] = get_u16(counts + 2 * i);
+    layout->value_count += layout->counts[i];
+  }
+  free(counts);
+
+  return true;
+}
+
+/*
+ * Stores the frame in the layout of the capture file. Values that the layout
+ * has no room for are dropped.
+ */
+void encode_capture_frame(const struct capture_layout* layout,
+    const struct frame* frame, unsigned char* out) {
+  unsigned int section, count, i;
+  int64_t timestamp = frame->timestamp;
+
+  for (i = 0; i < 8; i++) {
+    out[i] = (timestamp >> (8 * i)) & 0xFF;
+  }
+  out += 8;
+
+  for (section = 0; section <= SECTION_T * layout->pack_count; section++) {
+    unsigned int pack = section / SECTION_T;
+    int tag = (section == SECTION_T * layout->pack_count) ? SECTION_T
+        : section % SECTION_T;
+    const int* values = NULL;
+
+    count = 0;
+    if (tag == SECTION_T || pack < frame->pack_count) {
+      values = pack_values(frame, pack, tag, &count);
+    }
+
+    for (i = 0; i < layout->counts[section]; i++) {
+      int value = i < count ? values[i] : CAPTURE_MISSING;
+      if (value < 0 || value > CAPTURE_MISSING) {
+        value = CAPTURE_MISSING - 1;
+      }
+      put_u16(out, value);
+      out += 2;
+    }
+  }
+}
+
+void decode_capture_frame(const struct capture_layout* layout,
+    const unsigned char* in, struct frame* frame) {
+  unsigned int section, i, t;
+  uint64_t timestamp = 0;
+
+  for (i = 0; i < 8; i++) {
+    timestamp |= (uint64_t) in[i] << (8 * i);
+  }
+  in += 8;
+
+  frame->timestamp = timestamp;
+  frame->pack_count = 0;
+  frame->truncated = false;
+  for (t = 0; t < SECTION_TAG_COUNT; t++) {
+    frame->sections[t].count = 0;
+  }
+
+  for (section = 0; section <= SECTION_T * layout->pack_count; section++) {
+    unsigned int pack = section / SECTION_T;
+    int tag = (section == SECTION_T * layout->pack_count) ? SECTION_T
+        : section % SECTION_T;
+    struct section* values = &frame->sections[tag];
+    unsigned int* count = &values->count;
+
+    if (tag != SECTION_T && pack >= frame->pack_capacity) {
+      frame->truncated = true;
+      in += 2 * layout->counts[section];
+      continue;
+    }
+
+    if (tag == SECTION_B) {
+      frame->pack_count++;
+      for (t = 0; t < SECTION_TAG_COUNT; t++) {
+        frame->packs[pack].offset[t] = frame->sections[t].count;
+        frame->packs[pack].count[t] = 0;
+      }
+      frame->packs[pack].held = 0;
+    }
+    if (tag != SECTION_T) {
+      count = &frame->packs[pack].count[tag];
+    }
+
+    for (i = 0; i < layout->counts[section]; i++, in += 2) {
+      unsigned int value = get_u16(in);
+      if (value == CAPTURE_MISSING) {
+        continue;
+      }
+      if (*count >= frame->value_capacity) {
+        frame->truncated = true;
+        continue;
+      }
+
+      values->values[values->count] = value;
+      if (tag != SECTION_T) {
+        (*count)++;
+      }
+      values->count++;
+    }
+  }
+
+  // packs the frame did not have are stored with all values missing
+  while (frame->pack_count > 0) {
+    struct pack* last = &frame->packs[frame->pack_count - 1];
+    for (t = 0; t < SECTION_T && last->count[t] == 0; t++) {
+    }
+    if (t < SECTION_T) {
+      break;
+    }
+    frame->pack_count--;
+  }
+}
+
+// returns volts like "12.5" in tenths of volts, or -1 if they are not a number
+int parse_volts(const char* volts) {
+  char* end;
+  double value = strtod(volts, &end);
+
+  if (end == volts || *end != '\0' || value < 0 || value > 1000) {
+    return -1;
+  }
+  return round_to_int(10 * value);
+}
+
+void init_report(struct report* report, unsigned int pack_capacity,
+    unsigned int cell_capacity) {
+  unsigned int i;
+
+  report->pack_capacity = pack_capacity;
+  report->cell_capacity = cell_capacity;
+  report->frames = 0;
+  report->cells = calloc(pack_capacity * cell_capacity,
+      sizeof(struct value_stats));
+  report->imbalance = calloc(pack_capacity, sizeof(struct value_stats));
+  if (report->cells == NULL || report->imbalance == NULL) {
+    perror("Failed to allocate report");
+    exit(EXIT_FAILURE);
+  }
+
+  for (i = 0; i < pack_capacity * cell_capacity; i++) {
+    report->cells[i].min = INT_MAX;
+    report->cells[i].max = INT_MIN;
+  }
+  for (i = 0; i < pack_capacity; i++) {
+    report->imbalance[i].min = INT_MAX;
+    report->imbalance[i].max = INT_MIN;
+  }
+}
+
+void free_report(struct report* report) {
+  free(report->cells);
+  free(report->imbalance);
+}
+
+void add_frame_to_report(struct report* report, const struct frame* frame) {
+  unsigned int pack, count, i;
+
+  report->frames++;
+
+  for (pack = 0; pack < frame->pack_count && pack < report->pack_capacity;
+      pack++) {
+    const int* cells = pack_values(frame, pack, SECTION_B, &count);
+    struct value_stats* stats = &report->cells[pack * report->cell_capacity];
+    int min = INT_MAX;
+    int max = INT_MIN;
+
+    if (count > report->cell_capacity) {
+      count = report->cell_capacity;
+    }
+    for (i = 0; i < count; i++) {
+      add_value(&stats[i], cells[i]);
+      if (cells[i] < min) {
+        min = cells[i];
+      }
+      if (cells[i] > max) {
+        max = cells[i];
+      }
+    }
+
+    if (count > 0) {
+      add_value(&report->imbalance[pack], max - min);
+    }
+  }
+}
+
+void add_value(struct value_stats* stats, int value) {
+  stats->count++;
+  stats->sum += value;
+  stats->sum_squares += (long long) value * value;
+  if (value < stats->min) {
+    stats->min = value;
+  }
+  if (value > stats->max) {
+    stats->max = value;
+  }
+  if (value < LOW_VOLTS) {
+    stats->below++;
+  }
+  if (value > HIGH_VOLTS) {
+    stats->above++;
+  }
+}
+
+double stats_mean(const struct value_stats* stats) {
+  return (double) stats->sum / stats->count;
+}
+
+double stats_stddev(const struct value_stats* stats) {
+  long double n = stats->count;
+  long double variance = (n * stats->sum_squares - (long double) stats->sum
+      * stats->sum) / (n * n);
+
+  return variance > 0 ? sqrtl(variance) : 0;
+}
+
+/*
+ * Prints the report with voltages in volts and the time spent below
+ * --low-volts and above --high-volts as a share of the frames.
+ */
+void print_report_table(const struct report* report) {
+  unsigned int pack, cell;
+
+  printf("Frames: %llu\n\n", report->frames);
+  printf("Pack Cell    Min    Max    Mean  Stddev  Below %%  Above %%\n");
+
+  for (pack = 0; pack < report->pack_capacity; pack++) {
+    for (cell = 0; cell < report->cell_capacity; cell++) {
+      const struct value_stats* stats = &report->cells[pack
+          * report->cell_capacity + cell];
+      if (stats->count == 0) {
+        continue;
+      }
+
+      printf("%4u %4u %6.2f %6.2f %7.3f %7.3f %8.2f %8.2f\n", pack + 1,
+          cell + 1, stats->min / 10.0, stats->max / 10.0,
+          stats_mean(stats) / 10.0, stats_stddev(stats) / 10.0, 100.0
+              * stats->below / stats->count, 100.0 * stats->above
+              / stats->count);
+    }
+  }
+
+  printf("\nPack imbalance:\n");
+  printf("Pack    Min    Max    Mean\n");
+  for (pack = 0; pack < report->pack_capacity; pack++) {
+    const struct value_stats* stats = &report->imbalance[pack];
+    if (stats->count == 0) {
+      continue;
+    }
+
+    printf("%4u %6.2f %6.2f %7.3f\n", pack + 1, stats->min / 10.0, stats->max
+        / 10.0, stats_mean(stats) / 10.0);
+  }
+}
+
+void print_report_json(const struct report* report) {
+  unsigned int pack, cell;
+  bool first = true;
+
+  printf("{\n  \"frames\": %llu,\n  \"low_volts\": %.1f,\n"
+      "  \"high_volts\": %.1f,\n  \"cells\": [", report->frames, LOW_VOLTS
+      / 10.0, HIGH_VOLTS / 10.0);
+
+  for (pack = 0; pack < report->pack_capacity; pack++) {
+    for (cell = 0; cell < report->cell_capacity; cell++) {
+      const struct value_stats* stats = &report->cells[pack
+          * report->cell_capacity + cell];
+      if (stats->count == 0) {
+        continue;
+      }
+
+      printf("%s\n    { \"pack\": %u, \"cell\": %u, \"samples\": %llu, "
+          "\"min\": %.1f, \"max\": %.1f, \"mean\": %.4f, \"stddev\": %.4f, "
+          "\"below\": %llu, \"above\": %llu }", first ? "" : ",", pack + 1,
+          cell + 1, stats->count, stats->min / 10.0, stats->max / 10.0,
+          stats_mean(stats) / 10.0, stats_stddev(stats) / 10.0, stats->below,
+          stats->above);
+      first = false;
+    }
+  }
+
+  printf("\n  ],\n  \"imbalance\": [");
+  first = true;
+  for (pack = 0; pack < report->pack_capacity; pack++) {
+    const struct value_stats* stats = &report->imbalance[pack];
+    if (stats->count == 0) {
+      continue;
+    }
+
+    printf("%s\n    { \"pack\": %u, \"min\": %.1f, \"max\": %.1f, "
+        "\"mean\": %.4f }", first ? "" : ",", pack + 1, stats->min / 10.0,
+        stats->max / 10.0, stats_mean(stats) / 10.0);
+    first = false;
+  }
+  printf("\n  ]\n}\n");
+}
+
+// --report, reads the whole file without a screen and prints the statistics
+int run_report(char* file_name) {
+  struct ingest ingest = { .frames = NULL, .log = NULL, .keep_text = false,
+      .text = NULL, .text_size = 0 };
+  struct frame frame = { 0 };
+  struct report report;
+  char* text;
+
+  open_reader(&ingest.reader, file_name, false);
+
+  if (!alloc_input_frames(&ingest, &frame, 1)) {
+    alloc_frame(&frame, 1, 1);
+  }
+  init_report(&report, frame.pack_capacity, frame.value_capacity);
+
+  unsigned int jobs = JOBS;
+  if (jobs == 0) {
+    long processors = sysconf(_SC_NPROCESSORS_ONLN);
+    jobs = processors > 0 ? processors : 1;
+  }
+
+  if (ingest.reader.map != NULL && jobs > 1) {
+    run_parallel_report(&ingest.reader, &frame, &report, jobs);
+  } else {
+    while (read_frame(&ingest, &frame, &text) == READ_LINE) {
+      add_frame_to_report(&report, &frame);
+    }
+  }
+
+  if (REPORT == REPORT_JSON) {
+    print_report_json(&report);
+  } else {
+    print_report_table(&report);
+  }
+
+  free_report(&report);
+  free_frame(&frame);
+  free_frame(&ingest.previous);
+  free(ingest.text);
+  close_reader(&ingest.reader);
+
+  return EXIT_SUCCESS;
+}
+
+/*
+ * Converts the file to EXPORT_FILE in columns, one row group at a time, so
+ * that the memory it takes does not grow with the file.
+ */
+int run_export(char* file_name) {
+  struct ingest ingest = { .frames = NULL, .log = NULL, .keep_text = false,
+      .text = NULL, .text_size = 0 };
+  struct frame frame = { 0 };
+  struct export export;
+  char* text;
+
+  open_reader(&ingest.reader, file_name, false);
+  if (!alloc_input_frames(&ingest, &frame, 1)
+      || read_frame(&ingest, &frame, &text) == READ_EOF) {
+    printf("%s has no frames to export\n", file_name);
+    return EXIT_FAILURE;
+  }
+
+  open_export(&export, &frame);
+  do {
+    export_frame(&export, &frame);
+  } while (read_frame(&ingest, &frame, &text) == READ_LINE);
+  if (export.rows > 0) {
+    write_export_group(&export);
+  }
+
+  if (close(export.fd) == -1) {
+    perror("Failed to write export file");
+    exit(EXIT_FAILURE);
+  }
+  printf("Exported %lu frames in %lu row groups, %llu bytes to %s\n",
+      export.frames, export.groups, export.bytes, EXPORT_FILE);
+
+  free_export(&export);
+  free_frame(&frame);
+  free_frame(&ingest.previous);
+  free(ingest.text);
+  close_reader(&ingest.reader);
+
+  return EXIT_SUCCESS;
+}
+
+// creates EXPORT_FILE and writes the header, with the layout of the frame
+void open_export(struct export* export, const struct frame* frame) {
+  struct capture_layout* layout = &export->layout;
+  unsigned int section, i;
+
+  export->fd = open(EXPORT_FILE, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  if (export->fd == -1) {
+    perror("Failed to open export file");
+    exit(EXIT_FAILURE);
+  }
+
+  layout_from_frame(layout, frame);
+  export->rows = 0;
+  export->frames = 0;
+  export->groups = 0;
+  export->bytes = 0;
+  export->record = malloc(capture_record_size(layout));
+  export->times = malloc(EXPORT_GROUP_ROWS * sizeof(int64_t));
+  export->values = malloc((size_t) EXPORT_GROUP_ROWS * layout->value_count
+      * sizeof(uint16_t));
+  // as long as a column of times can be, and as long as the header
+  size_t column_size = EXPORT_GROUP_ROWS * 10 + 16 * (layout->value_count + 1)
+      + capture_header_size(layout);
+  export->column = malloc(column_size);
+  if (export->record == NULL || export->times == NULL
+      || export->values == NULL || export->column == NULL) {
+    perror("Failed to allocate export buffers");
+    exit(EXIT_FAILURE);
+  }
+
+  unsigned char* out = export->column;
+  size_t size = encode_capture_header(layout, out);
+  memcpy(out, EXPORT_MAGIC, 4);
+  put_u16(out + 4, EXPORT_VERSION);
+  put_u16(out + size, layout->value_count + 1);
+  size += 2;
+
+  out[size] = 4;
+  memcpy(out + size + 1, "time", 4);
+  size += 5;
+  for (section = 0; section <= SECTION_T * layout->pack_count; section++) {
+    unsigned int pack = section / SECTION_T;
+    bool counters = (section == SECTION_T * layout->pack_count);
+
+    for (i = 0; i < layout->counts[section]; i++) {
+      int length = counters ? sprintf((char*) out + size + 1, "T%u", i + 1)
+          : sprintf((char*) out + size + 1, "pack%u.%c%u", pack + 1,
+              SECTION_TAGS[section % SECTION_T], i + 1);
+      out[size] = length;
+      size += length + 1;
+    }
+  }
+  write_export(export, out, size);
+}
+
+// adds the frame to the row group, which is written when it is full
+void export_frame(struct export* export, const struct frame* frame) {
+  const unsigned char* values = export->record + 8;
+  unsigned int i;
+
+  encode_capture_frame(&export->layout, frame, export->record);
+  export->times[export->rows] = frame->timestamp;
+  for (i = 0; i < export->layout.value_count; i++) {
+    export->values[(size_t) i * EXPORT_GROUP_ROWS + export->rows]
+        = get_u16(values + 2 * i);
+  }
+  export->frames++;
+
+  if (++export->rows == EXPORT_GROUP_ROWS) {
+    write_export_group(export);
+  }
+}
+
+void write_export_group(struct export* export) {
+  unsigned char lengths[4];
+  unsigned int i;
+  size_t size;
+
+  put_u32(lengths, export->rows);
+  write_export(export, lengths, 4);
+
+  size = encode_export_column(export->column, export->times, NULL,
+      export->rows);
+  put_u32(lengths, size);
+  write_export(export, lengths, 4);
+  write_export(export, export->column, size);
+
+  for (i = 0; i < export->layout.value_count; i++) {
+    size = encode_export_column(export->column, NULL, export->values
+        + (size_t) i * EXPORT_GROUP_ROWS, export->rows);
+    put_u32(lengths, size);
+    write_export(export, lengths, 4);
+    write_export(export, export->column, size);
+  }
+
+  export->rows = 0;
+  export->groups++;
+}
+
+// encodes the times, or the values if times is NULL, as varint differences
+size_t encode_export_column(unsigned char* out, const int64_t* times,
+    const uint16_t* values, unsigned int rows) {
+  int64_t last = 0;
+  size_t size = 0;
+  unsigned int i;
+
+  for (i = 0; i < rows; i++) {
+    int64_t value = (times != NULL) ? times[i] : values[i];
+
+    size += put_varint(out + size, value - last);
+    last = value;
+  }
+  return size;
+}
+
+size_t put_varint(unsigned char* out, int64_t value) {
+  uint64_t zigzag = ((uint64_t) value << 1) ^ (uint64_t) (value >> 63);
+  size_t size = 0;
+
+  while (zigzag >= 0x80) {
+    out[size++] = (zigzag & 0x7F) | 0x80;
+    zigzag >>= 7;
+  }
+  out[size++] = zigzag;
+  return size;
+}
+
+void write_export(struct export* export, const void* data, size_t size) {
+  const char* bytes = data;
+
+  while (size > 0) {
+    ssize_t n = write(export->fd, bytes, size);
+    if (n == -1 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      perror("Failed to write export file");
+      exit(EXIT_FAILURE);
+    }
+    bytes += n;
+    size -= n;
+    export->bytes += n;
+  }
+}
+
+void free_export(struct export* export) {
+  free_layout(&export->layout);
+  free(export->record);
+  free(export->times);
+  free(export->values);
+  free(export->column);
+}
+
+/*
+ * Splits the rest of the mapped file into newline aligned chunks, reports on
+ * them in parallel and merges the chunk reports, in file order, into report.
+ * The statistics are integer sums, so the result is the same as reading the
+ * file in one thread. A chunk whose seed is not the frame the chunk before
+ * it ended with, after damage that the warm up lines did not get past, is
+ * reported on again from that frame.
+ */
+void run_parallel_report(struct line_reader* reader,
+    const struct frame* frame, struct report* report, unsigned int jobs) {
+  const char* start = reader->map + reader->map_offset;
+  const char* begin = start;
+  const char* end = reader->map + reader->map_size;
+  size_t chunk_size = (end - begin) / jobs + 1;
+  unsigned int i, line;
+
+  struct report_chunk* chunks = calloc(jobs, sizeof(struct report_chunk));
+  pthread_t* threads = calloc(jobs, sizeof(pthread_t));
+  if (chunks == NULL || threads == NULL) {
+    perror("Failed to allocate report chunks");
+    exit(EXIT_FAILURE);
+  }
+
+  for (i = 0; i < jobs; i++) {
+    struct report_chunk* chunk = &chunks[i];
+
+    chunk->begin = begin;
+    if (end - begin > chunk_size && i < jobs - 1) {
+      chunk->end = memchr(begin + chunk_size, '\n', end - begin - chunk_size);
+      chunk->end = (chunk->end != NULL) ? chunk->end + 1 : end;
+    } else {
+      chunk->end = end;
+    }
+    begin = chunk->end;
+
+    chunk->warmup = chunk->begin;
+    for (line = 0; line < REPORT_WARMUP_LINES && chunk->warmup > start;
+        line++) {
+      chunk->warmup--;
+      while (chunk->warmup > start && chunk->warmup[-1] != '\n') {
+        chunk->warmup--;
+      }
+    }
+
+    alloc_frame(&chunk->frame, frame->pack_capacity, frame->value_capacity);
+    alloc_frame(&chunk->previous, frame->pack_capacity,
+        frame->value_capacity);
+    alloc_frame(&chunk->seed, frame->pack_capacity, frame->value_capacity);
+    init_report(&chunk->report, report->pack_capacity,
+        report->cell_capacity);
+    if (pthread_create(&threads[i], NULL, report_chunk, chunk) != 0) {
+      perror("Failed to start report thread");
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  for (i = 0; i < jobs; i++) {
+    struct report_chunk* chunk = &chunks[i];
+
+    pthread_join(threads[i], NULL);
+    if (i > 0 && !same_frame(&chunk->seed, &chunks[i - 1].previous,
+        chunk->has_seed, chunks[i - 1].has_previous)) {
+      free_report(&chunk->report);
+      init_report(&chunk->report, report->pack_capacity,
+          report->cell_capacity);
+      copy_frame(&chunk->previous, &chunks[i - 1].previous);
+      chunk->has_previous = chunks[i - 1].has_previous;
+      report_lines(chunk, chunk->begin, chunk->end, true);
+    }
+    merge_report(report, &chunk->report);
+  }
+  for (i = 0; i < jobs; i++) {
+    free_report(&chunks[i].report);
+    free_frame(&chunks[i].frame);
+    free_frame(&chunks[i].previous);
+    free_frame(&chunks[i].seed);
+  }
+
+  reader->map_offset = reader->map_size;
+  free(chunks);
+  free(threads);
+}
+
+// report thread, parses the lines of one chunk into its own report
+void* report_chunk(void* arg) {
+  struct report_chunk* chunk = arg;
+
+  chunk->has_previous = false;
+  report_lines(chunk, chunk->warmup, chunk->begin, false);
+  copy_frame(&chunk->seed, &chunk->previous);
+  chunk->has_seed = chunk->has_previous;
+  report_lines(chunk, chunk->begin, chunk->end, true);
+
+  return NULL;
+}
+
+/*
+ * Parses the lines from begin to end, each repaired from the one before, and
+ * adds them to the report of the chunk if add is true.
+ */
+void report_lines(struct report_chunk* chunk, const char* begin,
+    const char* end, bool add) {
+  const char* line = begin;
+
+  while (line < end) {
+    const char* line_end = memchr(line, '\n', end - line);
+    if (line_end == NULL) {
+      line_end = end;
+    }
+
+    if (parse_frame_range(line, line_end, NULL, &chunk->frame,
+        chunk->has_previous ? &chunk->previous : NULL)) {
+      if (add) {
+        add_frame_to_report(&chunk->report, &chunk->frame);
+      }
+      copy_frame(&chunk->previous, &chunk->frame);
+      chunk->has_previous = true;
+    }
+    line = line_end + 1;
+  }
+}
+
+// whether two frames, each only there if its set is true, have the same values
+bool same_frame(const struct frame* a, const struct frame* b, bool a_set,
+    bool b_set) {
+  unsigned int i;
+
+  if (!a_set || !b_set) {
+    return a_set == b_set;
+  }
+  if (a->pack_count != b->pack_count || a->truncated != b->truncated) {
+    return false;
+  }
+  for (i = 0; i < a->pack_count; i++) {
+    if (memcmp(a->packs[i].count, b->packs[i].count,
+        sizeof(a->packs[i].count)) != 0
+        || a->packs[i].held != b->packs[i].held) {
+      return false;
+    }
+  }
+  for (i = 0; i < SECTION_TAG_COUNT; i++) {
+    if (a->sections[i].count != b->sections[i].count
+        || memcmp(a->sections[i].values, b->sections[i].values,
+        a->sections[i].count * sizeof(int)) != 0) {
+      return false;
+    }
+  }
+  return true;
+}
+
+void merge_report(struct report* into, const struct report* from) {
+  unsigned int i;
+
+  into->frames += from->frames;
+  for (i = 0; i < into->pack_capacity * into->cell_capacity; i++) {
+    merge_stats(&into->cells[i], &from->cells[i]);
+  }
+  for (i = 0; i < into->pack_capacity; i++) {
+    merge_stats(&into->imbalance[i], &from->imbalance[i]);
+  }
+}
+
+void merge_stats(struct value_stats* into, const struct value_stats* from) {
+  into->count += from->count;
+  into->sum += from->sum;
+  into->sum_squares += from->sum_squares;
+  into->below += from->below;
+  into->above += from->above;
+  if (from->min < into->min) {
+    into->min = from->min;
+  }
+  if (from->max > into->max) {
+    into->max = from->max;
+  }
+}
+
+void init_alarms(struct alarms* alarms, unsigned int capacity) {
+  alarms->capacity = capacity;
+  alarms->levels = malloc(capacity);
+  alarms->critical = false;
+  if (alarms->levels == NULL) {
+    finish_screen(0);
+    perror("Failed to allocate alarms");
+    exit(EXIT_FAILURE);
+  }
+  memset(alarms->levels, ALARM_NORMAL, capacity);
+
+  // hook commands must not read keys or draw on the screen
+  posix_spawn_file_actions_init(&alarms->hook_actions);
+  posix_spawn_file_actions_addopen(&alarms->hook_actions, STDIN_FILENO,
+      "/dev/null", O_RDONLY, 0);
+  posix_spawn_file_actions_addopen(&alarms->hook_actions, STDOUT_FILENO,
+      "/dev/null", O_WRONLY, 0);
+  posix_spawn_file_actions_adddup2(&alarms->hook_actions, STDOUT_FILENO,
+      STDERR_FILENO);
+}
+
+void free_alarms(struct alarms* alarms) {
+  posix_spawn_file_actions_destroy(&alarms->hook_actions);
+  free(alarms->levels);
+  alarms->levels = NULL;
+}
+
+void init_history(struct history* history, unsigned int capacity) {
+  unsigned int level;
+
+  history->capacity = capacity;
+  history->buckets = malloc((size_t) HISTORY_LEVELS * HISTORY_BUCKETS
+      * capacity * sizeof(struct history_bucket));
+  if (history->buckets == NULL) {
+    finish_screen(0);
+    perror("Failed to allocate history");
+    exit(EXIT_FAILURE);
+  }
+  for (level = 0; level < HISTORY_LEVELS; level++) {
+    history->newest[level] = 0;
+    clear_history_buckets(history, level, 0, HISTORY_BUCKETS - 1);
+  }
+  pthread_mutex_init(&history->lock, NULL);
+}
+
+void free_history(struct history* history) {
+  pthread_mutex_destroy(&history->lock);
+  free(history->buckets);
+  history->buckets = NULL;
+}
+
+// empties the buckets of a level from bucket number from to number to
+void clear_history_buckets(struct history* history, unsigned int level,
+    int64_t from, int64_t to) {
+  int64_t number;
+  unsigned int i;
+
+  if (to - from >= HISTORY_BUCKETS) {
+    from = to - HISTORY_BUCKETS + 1;
+  }
+  for (number = from; number <= to; number++) {
+    struct history_bucket* bucket = history->buckets + (level
+        * HISTORY_BUCKETS + number % HISTORY_BUCKETS) * history->capacity;
+
+    for (i = 0; i < history->capacity; i++) {
+      bucket[i].count = 0;
+    }
+  }
+}
+
+void init_cell_stats(struct cell_stats* stats, unsigned int capacity) {
+  stats->capacity = capacity;
+  stats->count = 0;
+  stats->started = false;
+  stats->averages = calloc(2 * capacity, sizeof(float));
+  if (stats->averages == NULL) {
+    finish_screen(0);
+    perror("Failed to allocate cell stats");
+    exit(EXIT_FAILURE);
+  }
+  stats->rates = stats->averages + capacity;
+}
+
+void free_cell_stats(struct cell_stats* stats) {
+  free(stats->averages);
+  stats->averages = NULL;
+}
+
+/*
+ * Time of the frame for the cell stats, in microseconds: the counters if it
+ * has them, so that a replay gives the rates of the recording, otherwise the
+ * time it was read.
+ */
+int64_t cell_stats_time(const struct frame* frame) {
+  if (frame->sections[SECTION_T].count > 0) {
+    return counter_time(frame);
+  }
+  return frame->timestamp;
+}
+
+/*
+ * Updates the moving average and the rate of every cell with the frame, and
+ * stores them in the frame with the deviation of every cell from the mean of
+ * its pack. The averages are exponential with CELL_AVERAGE_SECONDS as the
+ * time constant, the rate is the same average of how fast the moving
+ * average changes. A frame with the time of the last one only updates the
+ * deviations, one from before it (counters that wrapped) starts the time
+ * again.
+ */
+void update_cell_stats(struct cell_stats* stats, struct frame* frame) {
+  const struct section* cells = &frame->sections[SECTION_B];
+  int64_t time = cell_stats_time(frame);
+  float weight = 1; // of the new value, 1 starts the averages and the rates
+  float per_minute = 0;
+  unsigned int p;
+
+  if (cells->count != stats->count || cells->count > stats->capacity) {
+    stats->count = cells->count <= stats->capacity ? cells->count : 0;
+    stats->started = false;
+  }
+  if (stats->started) {
+    int64_t elapsed = time - stats->time;
+
+    weight = 0;
+    if (elapsed > 0) {
+      weight = 1 - expf(-elapsed / (CELL_AVERAGE_SECONDS * 1e6f));
+      per_minute = 60e6f / elapsed;
+    }
+    if (elapsed != 0) {
+      stats->time = time;
+    }
+  } else {
+    stats->time = time;
+  }
+
+  for (p = 0; p < frame->pack_count && stats->count > 0; p++) {
+    unsigned int offset = frame->packs[p].offset[SECTION_B];
+
+    update_pack_stats(cells->values + offset, frame->packs[p].count[SECTION_B],
+        frame->cell_stats[CELL_DEVIATION] + offset, stats->averages + offset,
+        stats->rates + offset, weight, per_minute);
+  }
+  stats->started = (stats->count > 0);
+
+  memcpy(frame->cell_stats[CELL_AVERAGE], stats->averages,
+      stats->count * sizeof(float));
+  memcpy(frame->cell_stats[CELL_RATE], stats->rates,
+      stats->count * sizeof(float));
+}
 
-  int i, j;
-  // strip white space
-  for (i = 0, j = 0; line[i] != '\0'; i++) {
-    if (NULL == strchr(" \t\r\n", line[i])) {
-      tmp[j++] = line[i];
+/*
+ * The cell stats of one pack. The arrays do not overlap and the loops have
+ * no branches, so that the compiler vectorises them.
+ */
+void update_pack_stats(const int* restrict volts, unsigned int count,
+    float* restrict deviations, float* restrict averages,
+    float* restrict rates, float weight, float per_minute) {
+  unsigned int i;
+  int sum = 0;
+
+  for (i = 0; i < count; i++) {
+    sum += volts[i];
+  }
+  float mean = (count > 0) ? (float) sum / count : 0;
+
+  for (i = 0; i < count; i++) {
+    float change = weight * (volts[i] - averages[i]);
+
+    deviations[i] = volts[i] - mean;
+    averages[i] += change;
+    rates[i] += weight * (change * per_minute - rates[i]);
+  }
+}
+
+/*
+ * Adds the cells of the frame to the bucket of every span that its timestamp
+ * falls in. The buckets that time went past without frames are emptied on
+ * the way, each of them once per turn of the ring, so a frame costs the same
+ * however much history is kept.
+ */
+void update_history(struct history* history, const struct frame* frame) {
+  const struct section* cells = &frame->sections[SECTION_B];
+  int64_t seconds = frame->timestamp / 1000000;
+  unsigned int count = cells->count < history->capacity ? cells->count
+      : history->capacity;
+  unsigned int level, i;
+
+  pthread_mutex_lock(&history->lock);
+  for (level = 0; level < HISTORY_LEVELS; level++) {
+    int64_t number = seconds / HISTORY_SPANS[level];
+    int64_t newest = history->newest[level];
+
+    if (number > newest) {
+      clear_history_buckets(history, level, newest + 1, number);
+      history->newest[level] = number;
+    } else if (number <= newest - HISTORY_BUCKETS) {
+      // a capture from before the ring starts it again
+      clear_history_buckets(history, level, number - HISTORY_BUCKETS + 1,
+          number);
+      history->newest[level] = number;
+    }
+
+    struct history_bucket* bucket = history->buckets + (level
+        * HISTORY_BUCKETS + number % HISTORY_BUCKETS) * history->capacity;
+    for (i = 0; i < count; i++) {
+      int volts = cells->values[i];
+
+      if (bucket[i].count == 0) {
+        bucket[i].min = volts;
+        bucket[i].max = volts;
+        bucket[i].sum = 0;
+      } else if (volts < bucket[i].min) {
+        bucket[i].min = volts;
+      } else if (volts > bucket[i].max) {
+        bucket[i].max = volts;
+      }
+      bucket[i].sum += volts;
+      bucket[i].count++;
     }
   }
-  tmp[j] = '\0';
+  pthread_mutex_unlock(&history->lock);
+}
+
+// level of a cell at this voltage, when it was at level before
+enum alarm_level alarm_level(int volts, enum alarm_level level) {
+  int hysteresis = ALARM_HYSTERESIS;
+
+  if (volts < CRITICAL_LOW_VOLTS
+      + (level == ALARM_CRITICAL_LOW ? hysteresis : 0)) {
+    return ALARM_CRITICAL_LOW;
+  }
+  if (volts < WARNING_LOW_VOLTS
+      + (level <= ALARM_WARNING_LOW ? hysteresis : 0)) {
+    return ALARM_WARNING_LOW;
+  }
+  if (volts > CRITICAL_HIGH_VOLTS
+      - (level == ALARM_CRITICAL_HIGH ? hysteresis : 0)) {
+    return ALARM_CRITICAL_HIGH;
+  }
+  if (volts > WARNING_HIGH_VOLTS
+      - (level >= ALARM_WARNING_HIGH ? hysteresis : 0)) {
+    return ALARM_WARNING_HIGH;
+  }
+  return ALARM_NORMAL;
+}
+
+/*
+ * Moves every cell of the frame to its new alarm level and stores the levels
+ * in the frame for the screen. Runs on every frame that is read, whether it
+ * is shown or not, and does not allocate.
+ */
+void check_alarms(struct alarms* alarms, struct frame* frame) {
+  const struct section* cells = &frame->sections[SECTION_B];
+  unsigned int i;
 
-  if (j == 0) {
-    valid_line = false;
+  for (i = 0; i < cells->count; i++) {
+    enum alarm_level level = alarm_level(cells->values[i], alarms->levels[i]);
+
+    if (level != alarms->levels[i]) {
+      alarms->levels[i] = level;
+      if (level == ALARM_CRITICAL_LOW || level == ALARM_CRITICAL_HIGH) {
+        alarms->critical = true;
+      }
+      if (ALARM_HOOK != NULL) {
+        run_alarm_hook(alarms, level, i + 1, cells->values[i]);
+      }
+    }
+    frame->alarms[i] = level;
   }
+}
 
-  // check that all characters are among ALLOWED_CHARS
-  for (i = 0; tmp[i] != '\0'; i++) {
-    if (NULL == strchr(ALLOWED_CHARS, tmp[i])) {
-      valid_line = false;
-      break;
+/*
+ * Starts --alarm-hook with the level name, cell number, voltage and source
+ * as $1, $2, $3 and $4 and does not wait for it. A hook that cannot be
+ * started is skipped, the screen keeps running.
+ */
+void run_alarm_hook(struct alarms* alarms, enum alarm_level level,
+    unsigned int cell, int volts) {
+  extern char** environ;
+  char cell_text[16];
+  char volts_text[16];
+  char* args[] = { "sh", "-c", ALARM_HOOK, "sh", (char*) ALARM_NAMES[level],
+      cell_text, volts_text, (char*) alarms->source, NULL };
+  pid_t pid;
+
+  snprintf(cell_text, sizeof(cell_text), "%u", cell);
+  snprintf(volts_text, sizeof(volts_text), "%d.%d", volts / 10, volts % 10);
+  posix_spawn(&pid, "/bin/sh", &alarms->hook_actions, NULL, args, environ);
+}
+
+/*
+ * Times every stage between the input and the screen or the output file on
+ * SOURCE, if there is one, and on generated lines with small, medium and
+ * large packs. Each stage runs alone over the input kept in memory.
+ */
+int run_benchmark(char* file_name) {
+  struct benchmark_input input;
+
+  printf("%-16s %-9s %9s %11s %12s %14s\n", "input", "stage", "records",
+      "ns/record", "records/s", "allocs/record");
+
+  if (file_name != NULL) {
+    load_benchmark_file(&input, file_name);
+    benchmark_input(&input);
+  }
+
+  generate_benchmark_input(&input, 1, 8, 100000);
+  benchmark_input(&input);
+  generate_benchmark_input(&input, 4, 16, 20000);
+  benchmark_input(&input);
+  generate_benchmark_input(&input, 16, 24, 5000);
+  benchmark_input(&input);
+
+  return EXIT_SUCCESS;
+}
+
+void load_benchmark_file(struct benchmark_input* input, char* file_name) {
+  struct stat st;
+  size_t done = 0;
+
+  int fd = open(file_name, O_RDONLY);
+  if (fd == -1 || fstat(fd, &st) == -1) {
+    perror("Failed to open file");
+    exit(EXIT_FAILURE);
+  }
+
+  input->size = st.st_size;
+  input->data = malloc(input->size + 1);
+  if (input->data == NULL) {
+    perror("Failed to allocate benchmark input");
+    exit(EXIT_FAILURE);
+  }
+  while (done < input->size) {
+    ssize_t count = read(fd, input->data + done, input->size - done);
+    if (count <= 0) {
+      perror("Failed to read file");
+      exit(EXIT_FAILURE);
+    }
+    done += count;
+  }
+  close(fd);
+
+  const char* base = strrchr(file_name, '/');
+  snprintf(input->name, sizeof(input->name), "%s",
+      base != NULL ? base + 1 : file_name);
+}
+
+/*
+ * Lines like the ones of a charger, with pack_count packs of cell_count cells
+ * that charge slowly, with some noise.
+ */
+void generate_benchmark_input(struct benchmark_input* input,
+    unsigned int pack_count, unsigned int cell_count, unsigned long lines) {
+  unsigned int random = 1;
+  size_t capacity = lines * (pack_count * (cell_count * 10 + 40) + 20);
+  size_t size = 0;
+  unsigned long line;
+  unsigned int pack, i;
+
+  input->data = malloc(capacity + 1);
+  if (input->data == NULL) {
+    perror("Failed to allocate benchmark input");
+    exit(EXIT_FAILURE);
+  }
+
+  for (line = 0; line < lines; line++) {
+    for (pack = 0; pack < pack_count; pack++) {
+      size += sprintf(input->data + size, "B,");
+      for (i = 0; i < cell_count; i++) {
+        random = random * 1103515245 + 12345;
+        size += sprintf(input->data + size, "%lu,", 80 + (line / 8 + 5 * i
+            + (random >> 16) % 3) % 71);
+      }
+      size += sprintf(input->data + size, "H,");
+      for (i = 0; i < cell_count; i++) {
+        random = random * 1103515245 + 12345;
+        size += sprintf(input->data + size, "%u,", 3000 + (random >> 16) % 800);
+      }
+      size += sprintf(input->data + size, "E,0,0,0,0,0,0,0,P,811,100,43,1,");
+    }
+    size += sprintf(input->data + size, "T,%lu,%lu,%lu,0,100,\r\n", line % 60,
+        line / 60 % 60, line / 3600);
+  }
+
+  input->size = size;
+  snprintf(input->name, sizeof(input->name), "generated-%ux%u", pack_count,
+      cell_count);
+}
+
+/*
+ * Writes line number line of pack_count packs of cell_count cells that charge
+ * and discharge slowly between 8 and 15 volts, with up to noise 0.1 volts of
+ * noise, and the T counters at seconds.
+ * Returns its length, which is at most pack_count * (cell_count * 10 + 40)
+ * + 40.
+ */
+size_t generate_line(char* out, unsigned int* random, unsigned int pack_count,
+    unsigned int cell_count, unsigned int noise, unsigned long line,
+    unsigned long seconds) {
+  size_t size = 0;
+  unsigned int pack, i;
+
+  for (pack = 0; pack < pack_count; pack++) {
+    size += sprintf(out + size, "B,");
+    for (i = 0; i < cell_count; i++) {
+      unsigned long charge = (line / 8 + 5 * i + next_random(random)
+          % (noise + 1)) % 140;
+      size += sprintf(out + size, "%lu,", 80 + (charge <= 70 ? charge
+          : 140 - charge));
+    }
+    size += sprintf(out + size, "H,");
+    for (i = 0; i < cell_count; i++) {
+      size += sprintf(out + size, "%u,", 3000 + next_random(random) % 800);
+    }
+    size += sprintf(out + size, "E,0,0,0,0,0,0,0,P,811,100,43,1,");
+  }
+  size += sprintf(out + size, "T,%lu,%lu,%lu,0,100,\r\n", seconds % 60,
+      seconds / 60 % 60, seconds / 3600 % 100000);
+  return size;
+}
+
+unsigned int next_random(unsigned int* random) {
+  *random = *random * 1103515245 + 12345;
+  return *random >> 16;
+}
+
+/*
+ * Damages the generated line the way a noisy serial line does: a byte that
+ * is not input, a lost tag or a line cut short. Returns its new length.
+ */
+size_t damage_line(char* line, size_t length, unsigned int* random) {
+  size_t text = length - 2; // without the "\r\n"
+  size_t position = next_random(random) % text;
+  size_t from;
+
+  switch (next_random(random) % 3) {
+  case 0:
+    line[position] = '#';
+    return length;
+
+  case 1:
+    for (from = position; from < text; from++) {
+      if (line[from] >= 'A' && line[from] <= 'Z') {
+        memmove(line + from, line + from + 1, length - from - 1);
+        return length - 1;
+      }
+    }
+    return length;
+
+  default:
+    memcpy(line + position, "\r\n", 2);
+    return position + 2;
+  }
+}
+
+/*
+ * Writes GENERATE_FRAMES lines of GENERATE_PACKS packs of GENERATE_CELLS
+ * cells to the file, a pipe or a terminal most likely, or to stdout, at
+ * GENERATE_RATE frames a second. At full speed they are written in blocks
+ * and the rate is what the reader keeps up with. Prints what it wrote on
+ * stderr when done, stopped or when the reader goes away.
+ */
+int run_generator(char* file_name) {
+  size_t line_size = GENERATE_PACKS * (GENERATE_CELLS * 10 + 40) + 40;
+  char* buffer = malloc(GENERATE_BUFFER_SIZE + line_size);
+  int fd = STDOUT_FILENO;
+  unsigned int random = 1;
+  unsigned long long frames = 0;
+  unsigned long long bytes = 0;
+  long long start = monotonic_us();
+  size_t size = 0;
+  bool reading = true; // the reader has not gone away
+
+  if (buffer == NULL) {
+    perror("Failed to allocate generator");
+    exit(EXIT_FAILURE);
+  }
+  if (file_name != NULL) {
+    fd = open(file_name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+      perror("Failed to open file");
+      exit(EXIT_FAILURE);
+    }
+  }
+  if (line_size > MAX_LINE_LENGTH) {
+    fprintf(stderr, "Lines are up to %zu bytes, read them with"
+        " --max-line-length=%zu\n", line_size, line_size);
+  }
+  // a reader that goes away ends the run with EPIPE instead
+  signal(SIGPIPE, SIG_IGN);
+  signal(SIGINT, stop_generator);
+  signal(SIGTERM, stop_generator);
+
+  while (reading && !generator_stopped && (GENERATE_FRAMES == 0
+      || frames < GENERATE_FRAMES)) {
+    long long now = monotonic_us();
+    unsigned long seconds = (GENERATE_RATE > 0) ? frames / GENERATE_RATE
+        : (now - start) / 1000000;
+    size_t length = generate_line(buffer + size, &random, GENERATE_PACKS,
+        GENERATE_CELLS, GENERATE_NOISE, frames, seconds);
+
+    if (GENERATE_ERRORS > 0 && next_random(&random) % 100 < GENERATE_ERRORS) {
+      length = damage_line(buffer + size, length, &random);
+    }
+    size += length;
+    frames++;
+
+    long long wait = 0;
+    if (GENERATE_RATE > 0) {
+      long long due = start + (long long) (frames * 1000000 / GENERATE_RATE);
+
+      // like the reader, one that is too far behind does not catch up
+      if (now - due > PACE_MAX_LAG) {
+        start += now - due;
+        due = now;
+      }
+      wait = due - now;
+    }
+    if (wait > 0 || size >= GENERATE_BUFFER_SIZE) {
+      reading = write_generated(fd, buffer, size);
+      bytes += size;
+      size = 0;
+    }
+    if (wait > 0) {
+      usleep(wait);
+    }
+  }
+  if (reading && size > 0) {
+    write_generated(fd, buffer, size);
+    bytes += size;
+  }
+
+  double elapsed = (monotonic_us() - start) / 1000000.0;
+  if (elapsed <= 0) {
+    elapsed = 1e-6;
+  }
+  fprintf(stderr, "Frames written:  %llu\n", frames);
+  fprintf(stderr, "Bytes written:   %llu\n", bytes);
+  fprintf(stderr, "Rate:            %.0f frames/s, %.1f MB/s\n",
+      frames / elapsed, bytes / elapsed / 1e6);
+
+  if (fd != STDOUT_FILENO) {
+    close(fd);
+  }
+  free(buffer);
+  return EXIT_SUCCESS;
+}
+
+void stop_generator(int sig) {
+  generator_stopped = 1;
+}
+
+// writes all of the data, false if the reader has gone away
+bool write_generated(int fd, const char* data, size_t size) {
+  while (size > 0) {
+    ssize_t count = write(fd, data, size);
+    if (count == -1 && errno == EINTR) {
+      if (generator_stopped) {
+        return false;
+      }
+      continue;
+    }
+    if (count == -1 && errno == EPIPE) {
+      return false;
+    }
+    if (count == -1) {
+      perror("Failed to write generated lines");
+      exit(EXIT_FAILURE);
+    }
+    data += count;
+    size -= count;
+  }
+  return true;
+}
+
+/*
+ * Finds the lines of the input and parses them once, untimed, for the text
+ * and the cells that the later stages start from.
+ */
+void prepare_benchmark_input(struct benchmark_input* input) {
+  struct frame frame = { .packs = NULL };
+  const char* begin = input->data;
+  const char* end = input->data + input->size;
+  size_t text_size = 0;
+  size_t cell_count = 0;
+
+  input->data[input->size] = '\n';
+  input->line_count = 0;
+  input->frame_count = 0;
+  input->max_cells = 0;
+  input->max_line_length = 0;
+  input->text = malloc(input->size + 1);
+  input->text_offsets = malloc((input->size / 2 + 1) * sizeof(size_t));
+  input->cell_offsets = malloc((input->size / 2 + 2) * sizeof(size_t));
+  input->cells = malloc((input->size / 2 + 1) * sizeof(int));
+  if (input->text == NULL || input->text_offsets == NULL
+      || input->cell_offsets == NULL || input->cells == NULL) {
+    perror("Failed to allocate benchmark input");
+    exit(EXIT_FAILURE);
+  }
+
+  while (begin < end) {
+    const char* line_end = memchr(begin, '\n', end - begin + 1);
+
+    input->line_count++;
+    if ((size_t) (line_end - begin) > input->max_line_length) {
+      input->max_line_length = line_end - begin;
+    }
+    if (frame.packs == NULL) {
+      alloc_frames_for_line(&frame, 1, begin, line_end);
+    }
+    if (frame.packs != NULL && parse_frame_range(begin, line_end,
+        input->text + text_size, &frame, NULL)) {
+      const struct section* cells = &frame.sections[SECTION_B];
+
+      input->text_offsets[input->frame_count] = text_size;
+      text_size += strlen(input->text + text_size) + 1;
+
+      input->cell_offsets[input->frame_count] = cell_count;
+      memcpy(input->cells + cell_count, cells->values,
+          cells->count * sizeof(int));
+      cell_count += cells->count;
+      if (cells->count > input->max_cells) {
+        input->max_cells = cells->count;
+      }
+      input->frame_count++;
+    }
+    begin = line_end + 1;
+  }
+  input->cell_offsets[input->frame_count] = cell_count;
+
+  if (frame.packs != NULL) {
+    free_frame(&frame);
+  }
+}
+
+void free_benchmark_input(struct benchmark_input* input) {
+  free(input->data);
+  free(input->text);
+  free(input->text_offsets);
+  free(input->cell_offsets);
+  free(input->cells);
+}
+
+void benchmark_input(struct benchmark_input* input) {
+  prepare_benchmark_input(input);
+
+  if (input->frame_count > 0) {
+    benchmark_validate(input);
+    benchmark_parse(input);
+    benchmark_bars(input);
+    benchmark_render(input);
+    benchmark_log(input);
+  } else {
+    printf("%-16s has no valid lines\n", input->name);
+  }
+  free_benchmark_input(input);
+}
+
+// the line validator, which also measures the packs of a line
+void benchmark_validate(const struct benchmark_input* input) {
+  const char* begin = input->data;
+  const char* end = input->data + input->size;
+  unsigned int pack_count, value_count;
+  unsigned long valid = 0;
+  struct benchmark_clock clock;
+
+  start_benchmark(&clock);
+  while (begin < end) {
+    const char* line_end = memchr(begin, '\n', end - begin + 1);
+    valid += measure_line(begin, line_end, &pack_count, &value_count);
+    begin = line_end + 1;
+  }
+  stop_benchmark(&clock);
+  print_benchmark(input, "validate", input->line_count, &clock);
+
+  if (valid == 0) {
+    printf("%-16s has no valid lines\n", input->name);
+  }
+}
+
+// the parser, into one frame and repairing from the last like the reader does
+void benchmark_parse(const struct benchmark_input* input) {
+  struct frame frame, previous;
+  const struct frame* last = NULL;
+  const char* begin = input->data;
+  const char* end = input->data + input->size;
+  char* line = malloc(input->max_line_length + 1);
+  struct benchmark_clock clock;
+
+  if (line == NULL) {
+    perror("Failed to allocate line buffer");
+    exit(EXIT_FAILURE);
+  }
+  alloc_frames_for_line(&frame, 1, input->text, NULL);
+  alloc_frame(&previous, frame.pack_capacity, frame.value_capacity);
+
+  start_benchmark(&clock);
+  while (begin < end) {
+    const char* line_end = memchr(begin, '\n', end - begin + 1);
+    if (parse_frame_range(begin, line_end, line, &frame, last)) {
+      copy_frame(&previous, &frame);
+      last = &previous;
+    }
+    begin = line_end + 1;
+  }
+  stop_benchmark(&clock);
+  print_benchmark(input, "parse", input->line_count, &clock);
+
+  free_frame(&frame);
+  free_frame(&previous);
+  free(line);
+}
+
+// the bar heights from BAR_LEVELS, over the cells of every frame
+void benchmark_bars(const struct benchmark_input* input) {
+  unsigned int* heights = malloc(input->max_cells * sizeof(unsigned int) + 1);
+  unsigned long sum = 0;
+  unsigned long i;
+  unsigned int j;
+  struct benchmark_clock clock;
+
+  if (heights == NULL) {
+    perror("Failed to allocate bars");
+    exit(EXIT_FAILURE);
+  }
+
+  start_benchmark(&clock);
+  for (i = 0; i < input->frame_count; i++) {
+    const int* volts = input->cells + input->cell_offsets[i];
+    unsigned int count = input->cell_offsets[i + 1] - input->cell_offsets[i];
+
+    for (j = 0; j < count; j++) {
+      int v = volts[j];
+      if (v < (int) VOLTS_MIN) {
+        v = VOLTS_MIN;
+      }
+      if (v > (int) VOLTS_MAX) {
+        v = VOLTS_MAX;
+      }
+      heights[j] = BAR_LEVELS[v - VOLTS_MIN].height;
+    }
+    sum += heights[0];
+  }
+  stop_benchmark(&clock);
+  print_benchmark(input, "bars", input->frame_count, &clock);
+
+  if (sum == 0) {
+    printf("%-16s has no bars\n", input->name);
+  }
+  free(heights);
+}
+
+// the screen, every frame drawn and refreshed into a terminal on /dev/null
+void benchmark_render(const struct benchmark_input* input) {
+  FILE* out = fopen("/dev/null", "w");
+  FILE* in = fopen("/dev/null", "r");
+  unsigned char* alarms = malloc(input->max_cells + 1);
+  struct frame frame = { .pack_count = 0 };
+  unsigned long i;
+  struct benchmark_clock clock;
+
+  if (out == NULL || in == NULL || alarms == NULL) {
+    perror("Failed to open /dev/null");
+    exit(EXIT_FAILURE);
+  }
+  memset(alarms, ALARM_NORMAL, input->max_cells + 1);
+
+  SCREEN* screen = NULL;
+  if (RENDERER == RENDERER_ANSI) {
+    start_ansi(fileno(out), false);
+  } else {
+    screen = newterm(getenv("TERM") != NULL ? NULL : "xterm", out, in);
+    if (screen == NULL) {
+      printf("%-16s %-9s skipped, no terminal type\n", input->name, "render");
+      fclose(out);
+      fclose(in);
+      free(alarms);
+      return;
+    }
+  }
+  setup_screen();
+  print_left_panel();
+  drawn_bar_count = 0;
+  first_bar = 0;
+  frame.alarms = alarms;
+
+  start_benchmark(&clock);
+  for (i = 0; i < input->frame_count; i++) {
+    size_t offset = input->cell_offsets[i];
+
+    frame.sections[SECTION_B].values = input->cells + offset;
+    frame.sections[SECTION_B].count = input->cell_offsets[i + 1] - offset;
+    print_battery_bars(&frame);
+    screen_refresh();
+  }
+  stop_benchmark(&clock);
+
+  finish_screen(0);
+  if (screen != NULL) {
+    delscreen(screen);
+  }
+  fclose(out);
+  fclose(in);
+  free(alarms);
+
+  print_benchmark(input, "render", input->frame_count, &clock);
+}
+
+// the output file writer, every frame queued and written to /dev/null
+void benchmark_log(const struct benchmark_input* input) {
+  struct log_ring log;
+  pthread_t log_thread;
+  unsigned long i;
+  struct benchmark_clock clock;
+
+  open_log(&log, "/dev/null");
+  log.format = OUTPUT_TEXT;
+
+  start_benchmark(&clock);
+  pthread_create(&log_thread, NULL, write_log, &log);
+  for (i = 0; i < input->frame_count; i++) {
+    // unlike the reader, waits for the disk to measure it
+    while (!log_line(&log, input->text + input->text_offsets[i])) {
+      usleep(1000);
     }
   }
+  atomic_store_explicit(&log.finished, true, memory_order_release);
+  pthread_join(log_thread, NULL);
+  stop_benchmark(&clock);
+  print_benchmark(input, "log", input->frame_count, &clock);
+
+  close(log.fd);
+  free(log.buffer);
+  free(log.record);
+  free_layout(&log.layout);
+}
+
+// heap allocations so far, or -1 if the build does not count them
+long long allocation_count() {
+#ifdef COUNT_ALLOCATIONS
+  return atomic_load_explicit(&allocations, memory_order_relaxed);
+#else
+  return -1;
+#endif
+}
+
+void start_benchmark(struct benchmark_clock* clock) {
+  clock->allocations = allocation_count();
+  clock->start_ns = monotonic_ns();
+}
 
-  if (valid_line) {
-    strcpy(line, tmp);
+void stop_benchmark(struct benchmark_clock* clock) {
+  clock->end_ns = monotonic_ns();
+  if (clock->allocations >= 0) {
+    clock->allocations = allocation_count() - clock->allocations;
   }
+}
 
-  free(tmp);
+void print_benchmark(const struct benchmark_input* input, const char* stage,
+    unsigned long records, const struct benchmark_clock* clock) {
+  double ns = clock->end_ns - clock->start_ns;
 
-  return valid_line;
+  if (ns < 1) {
+    ns = 1;
+  }
+  printf("%-16s %-9s %9lu %11.1f %12.0f ", input->name, stage, records,
+      ns / records, records * 1e9 / ns);
+  if (clock->allocations >= 0) {
+    printf("%14.3f\n", (double) clock->allocations / records);
+  } else {
+    printf("%14s\n", "-");
+  }
 }
 
 int main(int argc, char** argv) {
-  if (argc == 1) {
+  set_options(argc, argv);
+
+  char* fileName = (SOURCE_PATH_COUNT > 0) ? SOURCE_PATHS[0] : NULL;
+  init_char_classes();
+  if (GENERATE) {
+    return run_generator(fileName);
+  }
+  if (BENCHMARK) {
+    return run_benchmark(fileName);
+  }
+
+  if (fileName == NULL && DEVICE == NULL) {
     printf("Supply a file name\n");
     exit(EXIT_FAILURE);
   }
-  char* fileName = argv[1];
 
-  set_options(argc, argv);
+  if (EXPORT_FILE != NULL) {
+    if (fileName == NULL) {
+      printf("Supply a file name\n");
+      exit(EXIT_FAILURE);
+    }
+    return run_export(fileName);
+  }
+
+  if (REPORT != REPORT_NONE) {
+    if (fileName == NULL) {
+      printf("Supply a file name\n");
+      exit(EXIT_FAILURE);
+    }
+    return run_report(fileName);
+  }
+
+  source_count = SOURCE_PATH_COUNT + (DEVICE != NULL ? 1 : 0);
+  if (source_count > 1 && OUTPUT_FILE != NULL) {
+    printf("Supply a single source for --output-file\n");
+    exit(EXIT_FAILURE);
+  }
 
   init_screen();
 
-  print_left_panel();
-  refresh();
+  if (SHOWN_HISTORY < 0) {
+    print_left_panel();
+  }
+  screen_refresh();
+
+  struct log_ring log;
+  struct network_output network;
+  struct frame_ring* rings = calloc(source_count, sizeof(struct frame_ring));
+  sources = calloc(source_count, sizeof(struct source));
+  if (rings == NULL || sources == NULL) {
+    finish_screen(0);
+    perror("Failed to allocate sources");
+    exit(EXIT_FAILURE);
+  }
+  pthread_t reader_thread, log_thread, network_thread;
+  bool seekable = false;
+  unsigned int i;
+  int j;
+
+  for (i = 0; i < source_count; i++) {
+    struct ingest* ingest = &sources[i].ingest;
+
+    sources[i].name = (i < SOURCE_PATH_COUNT) ? SOURCE_PATHS[i] : DEVICE;
+    sources[i].level = ALARM_NORMAL;
+    ingest->frames = &rings[i];
+    ingest->index = i;
+    ingest->alarms.source = sources[i].name;
+    ingest->multiplexed = (source_count > 1);
+
+    if (i >= SOURCE_PATH_COUNT) {
+      open_device_reader(&ingest->reader, DEVICE, BAUD);
+    } else {
+      open_source(ingest, sources[i].name);
+    }
+
+    atomic_init(&ingest->jump, JUMP_NONE);
+    if ((START_AT_FRAME > 0 || START_AT_TIME >= 0)
+        && reader_seekable(&ingest->reader)) {
+      atomic_init(&ingest->jump, JUMP_START_AT);
+      seekable = true;
+    }
+  }
+  if ((START_AT_FRAME > 0 || START_AT_TIME >= 0) && !seekable) {
+    finish_screen(0);
+    printf("Supply a file that is not followed for --start-at\n");
+    exit(EXIT_FAILURE);
+  }
 
-  FILE* outFile;
   if (OUTPUT_FILE != NULL) {
-    outFile = open_file(OUTPUT_FILE, "a");
+    open_log(&log, OUTPUT_FILE);
+    sources[0].ingest.log = &log;
+    sources[0].ingest.keep_text = (log.format == OUTPUT_TEXT);
   }
+  struct log_ring* output = sources[0].ingest.log;
 
-  int voltages[25];
-  char line[MAX_LINE_LENGTH];
+  if (PUBLISH != NULL) {
+    open_network_output(&network, PUBLISH);
+    for (i = 0; i < source_count; i++) {
+      sources[i].ingest.network = &network;
+    }
+    pthread_create(&network_thread, NULL, send_network_frames, &network);
+  }
+  if (output != NULL) {
+    pthread_create(&log_thread, NULL, write_log, output);
+  }
+  if (ALARM_HOOK != NULL) {
+    // hooks are not waited for
+    signal(SIGCHLD, SIG_IGN);
+  }
+  if (source_count > 1) {
+    print_tabs();
+    pthread_create(&reader_thread, NULL, read_sources, NULL);
+  } else {
+    pthread_create(&reader_thread, NULL, read_frames, &sources[0].ingest);
+  }
 
   for (;;) {
-    FILE* dataFile = open_file(fileName, "r");
+    bool finished = sources_finished();
+    bool drawn = false;
+    long long start = monotonic_ns();
 
-    while (fgets(line, sizeof(line), dataFile)) {
-      if (is_valid_line(line)) {
-        if (OUTPUT_FILE != NULL) {
-          append_data_line(outFile, line);
-        }
-        read_voltages(line, voltages);
-
-        int i;
-        int batteries_size;
-        for (i = 0; i < sizeof(voltages) / sizeof(int); i++) {
-          if (voltages[i] == -1) {
-            batteries_size = i;
-            break;
-          }
-        }
+    if (screen_resized) {
+      resize_screen();
+      screen_refresh();
+    }
+    if (stats_requested) {
+      dump_stats();
+    }
+    read_keys();
 
-        int batteries[batteries_size];
-        memcpy(batteries, voltages, batteries_size * sizeof(int));
+    for (i = 0; i < source_count; i++) {
+      struct frame_ring* ring = sources[i].ingest.frames;
+      unsigned int head;
 
-        print_bottom_panel(batteries_size);
-        print_battery_bars(batteries_size, batteries);
-        refresh();
+      const struct frame* frame = newest_frame(ring, &head);
+      if (frame == NULL) {
+        continue;
+      }
+      if (!drawn) {
+        start = monotonic_ns();
+        drawn = true;
+      }
+      remember_frame(&sources[i], frame);
+      if ((int) i == shown_source && SHOWN_HISTORY < 0) {
+        print_battery_bars(frame);
+        if (SHOWN_CELL_STATS != 0) {
+          print_cell_stats(&sources[i]);
+        }
+      }
+      release_frames(ring, head);
+    }
 
-        if (FRAME_INTERVAL > 0) {
-          usleep(FRAME_INTERVAL);
+    if (drawn) {
+      if (source_count > 1) {
+        if (shown_source == SOURCE_SUMMARY) {
+          print_summary();
         }
+        print_tabs();
+      }
+      if (SHOWN_HISTORY >= 0 && shown_source != SOURCE_SUMMARY) {
+        print_history(&sources[shown_source]);
       }
+      update_status_line(false);
+      long long printed = monotonic_ns();
+      screen_refresh();
+
+      add_stat(&stats.frames_drawn, 1);
+      add_stat(&stats.draw_ns, printed - start);
+      add_stat(&stats.refresh_ns, monotonic_ns() - printed);
+    } else if (finished) {
+      break;
     }
 
-    int isEof = feof(dataFile);
+    usleep(REFRESH_INTERVAL);
+  }
 
-    close_file(dataFile);
+  pthread_join(reader_thread, NULL);
 
-    if (isEof) {
-      break;
+  if (PUBLISH != NULL) {
+    atomic_store_explicit(&network.finished, true, memory_order_release);
+    pthread_join(network_thread, NULL);
+    if (network.fd != -1) {
+      close(network.fd);
     }
+    free(network.buffer);
+    free(network.frame);
+  }
+  if (output != NULL) {
+    pthread_join(log_thread, NULL);
+    close(log.fd);
+    free(log.buffer);
+    free(log.record);
+    free_layout(&log.layout);
   }
 
-  getch();
+  bool alarm_exit = false;
+  for (i = 0; i < source_count; i++) {
+    struct ingest* ingest = &sources[i].ingest;
 
-  if (OUTPUT_FILE != NULL) {
-    close_file(outFile);
+    close_reader(&ingest->reader);
+    free(ingest->text);
+    free(ingest->file_index.entries);
+    free_frame(&ingest->previous);
+    alarm_exit |= ingest->alarms.critical && ALARM_EXIT_STATUS != 0;
+    if (ingest->alarms.levels != NULL) {
+      free_alarms(&ingest->alarms);
+      free_cell_stats(&ingest->cell_stats);
+    }
+  }
+
+  if (!alarm_exit) {
+    wait_for_key();
+  }
+
+  for (i = 0; i < source_count; i++) {
+    if (atomic_load(&rings[i].ready)) {
+      for (j = 0; j < FRAME_RING_SIZE + 2; j++) {
+        free_frame(&rings[i].frames[j]);
+      }
+      free_history(&sources[i].ingest.history);
+    }
+    free(sources[i].volts);
+    free(sources[i].levels);
+    free(sources[i].cell_stats);
   }
+  free(drawn_heights);
+  free(drawn_colours);
+  free(drawn_volts);
+  free(BAR_LEVELS);
 
   finish_screen(0);
-  return EXIT_SUCCESS;
+
+  if (PRINT_STATS) {
+    struct stats_snapshot snapshot;
+    take_stats(&snapshot);
+    print_stats(stderr, &snapshot);
+  }
+  if (output != NULL) {
+    printf("Wrote %lu records, %lu bytes to %s, dropped %lu\n",
+        atomic_load(&log.records_written), atomic_load(&log.bytes_written),
+        OUTPUT_FILE, atomic_load(&log.records_dropped));
+  }
+  if (PUBLISH != NULL) {
+    printf("Sent %lu frames, %lu bytes to %s, dropped %lu\n",
+        atomic_load(&network.frames_sent), atomic_load(&network.bytes_sent),
+        PUBLISH, atomic_load(&network.frames_dropped));
+  }
+  free(sources);
+  free(rings);
+  return alarm_exit ? ALARM_EXIT_STATUS : EXIT_SUCCESS;
 }
@@ -1 +1 @@
-gcc battery-monitor.c -o battery-monitor -lncurses -march=i386 && ./battery-monitor
+make && ./battery-monitor